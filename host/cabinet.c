@@ -0,0 +1,415 @@
+/*
+	cabinet
+
+	The controller on a serial line the host can reach, so the protocol
+	can be driven with the same tools as a cabinet in the field. Bytes
+	from the line go through sciRxIsr to the serial task's frame parser,
+	and everything the serial task sends on SCI0 goes back down the line.
+	The line runs at 9600 baud, so a tick takes in at most 10 bytes.
+
+		cabinet pty			on a pseudo terminal, its name is printed
+		cabinet tcp [port]	on a TCP port, 5700 if not given, one client at a time
+		cabinet test		protocol self test over a socket pair
+
+	pty and tcp run in real time with the sensors idle. Bytes sent while
+	nothing is reading are lost, as on a real line. The self test plays
+	the central station against a cabinet running as fast as it goes.
+*/
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "ctl.h"
+
+#define TICKS_PER_SEC		100
+
+//9600 baud, 10 bits a byte
+#define RX_BYTES_PER_TICK	10
+
+#define DEFAULT_PORT		5700
+
+//The serial protocol, as the README gives it
+#define PROTO_SYNC			0x7E
+#define PROTO_MAX_PAYLOAD	48
+#define PROTO_REPLY			0x80
+
+#define CMD_PLAN_UPLOAD		0x01
+#define CMD_PLAN_QUERY		0x02
+#define CMD_MODE_SET		0x07
+
+#define PROTO_ACK			0
+#define PROTO_NAK_LENGTH	1
+#define PROTO_NAK_RANGE		2
+#define PROTO_NAK_UNKNOWN	3
+
+#define TELEM_KEYFRAME		0x40
+#define TELEM_BIT			0x42
+
+#define PLAN_WIRE_SIZE		10
+
+//How long the self test waits for a reply
+#define REPLY_TICKS			(2 * TICKS_PER_SEC)
+
+
+ctl* cab;
+hostPorts* ports;
+INT32U now;
+INT32U sent;			//sciTx bytes written to the line so far
+
+//Self test, the station's side
+int station;
+INT8U rxBuf[2 + PROTO_MAX_PAYLOAD];
+int rxGot;
+int telemFrames;
+int checks;
+int failures;
+
+
+//cabinetTick
+//One tick of the cabinet on the line fd, -1 if there is no line
+//Returns 0 once the far end has closed it
+int cabinetTick(int fd)
+{
+	INT8U buf[HOST_SCI_TX_SIZE];
+	int n,
+		i;
+
+	now++;
+	if(fd >= 0)
+	{
+		n = read(fd, buf, RX_BYTES_PER_TICK);
+		if(n == 0)
+			return 0;
+		for(i = 0; i < n; i++)
+			ctlRxByte(buf[i]);
+	}
+
+	ctlStep(now, 0);
+	ctlSerial();
+
+	n = 0;
+	while(sent != ports->sciTxHead)
+		buf[n++] = ports->sciTx[sent++ & (HOST_SCI_TX_SIZE - 1)];
+	if(fd >= 0 && n)
+		(void)write(fd, buf, n);
+
+	return 1;
+}
+
+
+//realTime
+//Sleeps until tick now is due
+void realTime(struct timespec* start)
+{
+	struct timespec due;
+	long long ns;
+
+	ns = (long long)now * (1000000000 / TICKS_PER_SEC);
+	due.tv_sec = start->tv_sec + ns / 1000000000;
+	due.tv_nsec = start->tv_nsec + ns % 1000000000;
+	if(due.tv_nsec >= 1000000000)
+	{
+		due.tv_sec++;
+		due.tv_nsec -= 1000000000;
+	}
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+}
+
+
+//runPty
+int runPty(void)
+{
+	struct timespec start;
+	int fd;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(fd < 0 || grantpt(fd) || unlockpt(fd))
+	{
+		perror("cabinet: pty");
+		return 2;
+	}
+	printf("cabinet on %s\n", ptsname(fd));
+	fflush(stdout);
+
+	//Reads fail with EIO while no one has the terminal open, which is a quiet line
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(;;)
+	{
+		cabinetTick(fd);
+		realTime(&start);
+	}
+}
+
+
+//runTcp
+int runTcp(int port)
+{
+	struct sockaddr_in addr;
+	struct timespec start;
+	int lfd,
+		fd,
+		on;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	on = 1;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if(bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) || listen(lfd, 1))
+	{
+		perror("cabinet: tcp");
+		return 2;
+	}
+	fcntl(lfd, F_SETFL, O_NONBLOCK);
+	printf("cabinet on 127.0.0.1:%d\n", port);
+	fflush(stdout);
+
+	fd = -1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(;;)
+	{
+		if(fd < 0)
+		{
+			fd = accept(lfd, NULL, NULL);
+			if(fd >= 0)
+				fcntl(fd, F_SETFL, O_NONBLOCK);
+		}
+
+		if(!cabinetTick(fd))
+		{
+			close(fd);
+			fd = -1;
+		}
+		realTime(&start);
+	}
+}
+
+
+//sendFrame
+//The station sends a frame, with its checksum spoilt if bad is set
+void sendFrame(INT8U cmd, INT8U* payload, INT8U len, int bad)
+{
+	INT8U buf[4 + PROTO_MAX_PAYLOAD];
+	INT8U sum;
+	int i;
+
+	buf[0] = PROTO_SYNC;
+	buf[1] = len;
+	buf[2] = cmd;
+	sum = len + cmd;
+	for(i = 0; i < len; i++)
+	{
+		buf[3 + i] = payload[i];
+		sum += payload[i];
+	}
+	buf[3 + len] = (INT8U)(0 - sum) + (bad ? 1 : 0);
+
+	(void)write(station, buf, 4 + len);
+}
+
+
+//stationRx
+//Station's frame parser, returns 1 with a whole frame in rxBuf as LEN CMD PAYLOAD
+int stationRx(INT8U data)
+{
+	INT8U sum;
+	int i;
+
+	if(rxGot == 0 && data != PROTO_SYNC)
+		return 0;
+	if(rxGot == 0)
+	{
+		rxGot = 1;
+		return 0;
+	}
+
+	rxBuf[rxGot - 1] = data;
+	rxGot++;
+	if(rxBuf[0] > PROTO_MAX_PAYLOAD)
+	{
+		rxGot = 0;
+		return 0;
+	}
+	if(rxGot < rxBuf[0] + 4)
+		return 0;
+
+	rxGot = 0;
+	sum = 0;
+	for(i = 0; i < rxBuf[0] + 3; i++)
+		sum += rxBuf[i];
+	return sum == 0;
+}
+
+
+//awaitReply
+//Runs the cabinet until the reply to cmd comes, returns its payload length or -1
+int awaitReply(int fd, INT8U cmd, INT8U* payload)
+{
+	INT8U data;
+	INT32U end;
+
+	end = now + REPLY_TICKS;
+	while(now < end)
+	{
+		cabinetTick(fd);
+		while(read(station, &data, 1) == 1)
+		{
+			if(!stationRx(data))
+				continue;
+			if(rxBuf[1] >= TELEM_KEYFRAME && rxBuf[1] <= TELEM_BIT)
+				telemFrames++;
+			if(rxBuf[1] == (cmd | PROTO_REPLY))
+			{
+				memcpy(payload, rxBuf + 2, rxBuf[0]);
+				return rxBuf[0];
+			}
+		}
+	}
+
+	return -1;
+}
+
+
+//expect
+void expect(int ok, const char* what)
+{
+	checks++;
+	if(!ok)
+	{
+		fprintf(stderr, "cabinet: %s\n", what);
+		failures++;
+	}
+}
+
+
+//planBytes
+void planBytes(INT8U* p, INT16U allRed, INT16U yellow, INT16U go, INT16U turn, INT16U turnGo)
+{
+	INT16U v[5];
+	int i;
+
+	v[0] = allRed;
+	v[1] = yellow;
+	v[2] = go;
+	v[3] = turn;
+	v[4] = turnGo;
+	for(i = 0; i < 5; i++)
+	{
+		p[2 * i] = v[i] >> 8;
+		p[2 * i + 1] = v[i];
+	}
+}
+
+
+//runTest
+//The station's side of a retiming, and every way a frame can be refused
+int runTest(void)
+{
+	INT8U plan[PLAN_WIRE_SIZE],
+			mine[PLAN_WIRE_SIZE],
+			reply[PROTO_MAX_PAYLOAD],
+			b;
+	int sv[2],
+		fd,
+		n;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+	{
+		perror("cabinet: socketpair");
+		return 2;
+	}
+	fd = sv[0];
+	station = sv[1];
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	fcntl(station, F_SETFL, O_NONBLOCK);
+
+	//The power on plan
+	sendFrame(CMD_PLAN_QUERY, NULL, 0, 0);
+	n = awaitReply(fd, CMD_PLAN_QUERY, plan);
+	planBytes(mine, 3000, 2000, 12000, 6000, 7000);
+	expect(n == PLAN_WIRE_SIZE && !memcmp(plan, mine, PLAN_WIRE_SIZE), "power on plan not reported");
+
+	//Noise on the line before a frame is skipped, the frame takes two ticks to come in
+	b = 0x55;
+	(void)write(station, &b, 1);
+	planBytes(mine, 2000, 3000, 15000, 5000, 10000);
+	sendFrame(CMD_PLAN_UPLOAD, mine, PLAN_WIRE_SIZE, 0);
+	n = awaitReply(fd, CMD_PLAN_UPLOAD, reply);
+	expect(n == 1 && reply[0] == PROTO_ACK, "good plan not accepted");
+
+	//It takes over at the next cycle boundary, a cycle is well under two minutes
+	while(now < 120 * TICKS_PER_SEC)
+		cabinetTick(fd);
+	sendFrame(CMD_PLAN_QUERY, NULL, 0, 0);
+	n = awaitReply(fd, CMD_PLAN_QUERY, plan);
+	expect(n == PLAN_WIRE_SIZE && !memcmp(plan, mine, PLAN_WIRE_SIZE), "uploaded plan not running after a cycle");
+
+	//Refused
+	planBytes(plan, 2000, 500, 15000, 5000, 10000);
+	sendFrame(CMD_PLAN_UPLOAD, plan, PLAN_WIRE_SIZE, 0);
+	n = awaitReply(fd, CMD_PLAN_UPLOAD, reply);
+	expect(n == 1 && reply[0] == PROTO_NAK_RANGE, "short yellow not refused");
+
+	sendFrame(CMD_PLAN_UPLOAD, plan, 3, 0);
+	n = awaitReply(fd, CMD_PLAN_UPLOAD, reply);
+	expect(n == 1 && reply[0] == PROTO_NAK_LENGTH, "short payload not refused");
+
+	sendFrame(0x33, NULL, 0, 0);
+	n = awaitReply(fd, 0x33, reply);
+	expect(n == 1 && reply[0] == PROTO_NAK_UNKNOWN, "unknown command not refused");
+
+	b = 9;
+	sendFrame(CMD_MODE_SET, &b, 1, 0);
+	n = awaitReply(fd, CMD_MODE_SET, reply);
+	expect(n == 1 && reply[0] == PROTO_NAK_RANGE, "unknown mode not refused");
+
+	//A bad checksum gets no reply at all, and the plan stays
+	planBytes(plan, 1000, 2000, 2000, 2000, 2000);
+	sendFrame(CMD_PLAN_UPLOAD, plan, PLAN_WIRE_SIZE, 1);
+	n = awaitReply(fd, CMD_PLAN_UPLOAD, reply);
+	expect(n < 0, "frame with a bad checksum answered");
+
+	b = 1;
+	sendFrame(CMD_MODE_SET, &b, 1, 0);
+	n = awaitReply(fd, CMD_MODE_SET, reply);
+	expect(n == 1 && reply[0] == PROTO_ACK, "predictive mode not accepted");
+
+	while(now < 240 * TICKS_PER_SEC)
+		cabinetTick(fd);
+	sendFrame(CMD_PLAN_QUERY, NULL, 0, 0);
+	n = awaitReply(fd, CMD_PLAN_QUERY, plan);
+	expect(n == PLAN_WIRE_SIZE && !memcmp(plan, mine, PLAN_WIRE_SIZE), "plan changed by refused frames");
+
+	expect(telemFrames > 0, "no telemetry on the line");
+	expect(ctlConflict() == FAULT_NONE, "conflict fault");
+
+	printf("%d of %d checks passed, %d telemetry frames seen, %u s\n",
+		checks - failures, checks, telemFrames, now / TICKS_PER_SEC);
+
+	return failures ? 1 : 0;
+}
+
+
+int main(int argc, char** argv)
+{
+	cab = ctlCreate();
+	ports = ctlPorts(cab);
+
+	if(argc > 1 && !strcmp(argv[1], "pty"))
+		return runPty();
+	if(argc > 1 && !strcmp(argv[1], "tcp"))
+		return runTcp(argc > 2 ? atoi(argv[2]) : DEFAULT_PORT);
+	if(argc > 1 && !strcmp(argv[1], "test"))
+		return runTest();
+
+	fprintf(stderr, "cabinet pty | tcp [port] | test\n");
+	return 2;
+}
@@ -0,0 +1,293 @@
+/*
+	coro
+
+	Runs many intersections on one thread as C++20 coroutines under a
+	single scheduler, with no stack per intersection.
+
+	On the board the light cycle and the ambulance handler are
+	protothreads inside the controller task, and everything they keep
+	across a wait is in the intersection struct. Here every intersection
+	is a coroutine that steps its controller once a tick and then
+	suspends. Its sensors are coroutines too: turn calls and ambulances
+	come and go after random waits. A suspended coroutine is only its heap
+	frame, a few dozen bytes. Sleeping coroutines wait on a timing wheel
+	and cost nothing until their tick comes round.
+
+	Intersection 0 logs its inputs and greens. After the run they are
+	replayed on a fresh controller stepped directly, and the greens must
+	match tick for tick.
+
+		coro [intersections] [seconds] [mode]
+*/
+#include <coroutine>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+extern "C" {
+#include "ctl.h"
+}
+
+#define TICKS_PER_SEC	100
+
+//Sensor bits on PORTA
+#define TURN_FLAG(app)	(1 << (app))
+#define AMB_FLAG(app)	(16 << (app))
+
+#define NUM_APPROACHES	4
+
+//Mean time between turn calls on an approach, and how long one holds the detector
+#define TURN_GAP_TICKS	(40 * TICKS_PER_SEC)
+#define TURN_HOLD_TICKS	(4 * TICKS_PER_SEC)
+
+//Mean time between ambulances at an intersection, and how long one is seen for
+#define AMB_GAP_TICKS		(3600 * TICKS_PER_SEC)
+#define AMB_HOLD_TICKS	(8 * TICKS_PER_SEC)
+
+
+//Coroutine frame bytes allocated so far
+static unsigned long long frameBytes;
+static unsigned long long frames;
+
+
+//task
+//A coroutine owned by the scheduler, it starts suspended and never finishes
+struct task{
+	struct promise_type{
+		task get_return_object()
+		{
+			return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+		}
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::abort(); }
+
+		//Counted so the report can show what a suspended intersection costs
+		void* operator new(std::size_t n)
+		{
+			frameBytes += n;
+			frames++;
+			return ::operator new(n);
+		}
+		void operator delete(void* p) { ::operator delete(p); }
+	};
+
+	std::coroutine_handle<promise_type> h;
+};
+
+
+//scheduler
+//Timing wheel of suspended coroutines, one slot per tick
+//A sleep longer than the wheel comes round and is put back until its tick
+struct scheduler{
+	static const unsigned WHEEL = 4096;
+
+	struct entry{
+		INT32U wake;
+		std::coroutine_handle<> h;
+	};
+
+	std::vector<entry> slots[WHEEL];
+	std::vector<entry> due;
+	std::vector<std::coroutine_handle<>> owned;
+	INT32U now = 0;
+
+	struct sleeper{
+		scheduler& s;
+		INT32U ticks;
+
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h) { s.at(s.now + (ticks ? ticks : 1), h); }
+		void await_resume() const noexcept {}
+	};
+
+	//co_await sleep(n) resumes n ticks later, at least the next tick
+	sleeper sleep(INT32U ticks) { return sleeper{*this, ticks}; }
+
+	void at(INT32U wake, std::coroutine_handle<> h) { slots[wake % WHEEL].push_back(entry{wake, h}); }
+
+	//Takes a new coroutine, it first runs on the next tick
+	void spawn(task t)
+	{
+		owned.push_back(t.h);
+		at(now + 1, t.h);
+	}
+
+	//Runs every tick up to end, coroutines due in a tick run in the order they went to sleep
+	void run(INT32U end)
+	{
+		while(now < end)
+		{
+			now++;
+			due.swap(slots[now % WHEEL]);
+			for(entry& e : due)
+			{
+				if(e.wake == now)
+					e.h.resume();
+				else
+					at(e.wake, e.h);
+			}
+			due.clear();
+		}
+	}
+
+	~scheduler()
+	{
+		for(std::coroutine_handle<> h : owned)
+			h.destroy();
+	}
+};
+
+
+//board
+//What a controller is wired to: its sensor port
+struct board{
+	ctl* c;
+	INT8U inputs;
+	INT32U rng;
+	INT32U conflicts;
+
+	//Replay log, kept for intersection 0 only
+	bool logging;
+	std::vector<INT8U> loggedInputs;
+	std::vector<INT8U> loggedGreens;
+};
+
+
+//nextRandom
+//xorshift32, one stream per board
+static INT32U nextRandom(board& b)
+{
+	b.rng ^= b.rng << 13;
+	b.rng ^= b.rng >> 17;
+	b.rng ^= b.rng << 5;
+	return b.rng;
+}
+
+
+//controller
+//controllerTask's loop: one step a tick with whatever the sensors show
+static task controller(scheduler& s, board& b)
+{
+	for(;;)
+	{
+		ctlSelect(b.c);
+		ctlStep(s.now, b.inputs);
+		if(ctlConflict())
+			b.conflicts++;
+
+		if(b.logging)
+		{
+			b.loggedInputs.push_back(b.inputs);
+			b.loggedGreens.push_back(ctlGreens());
+		}
+
+		co_await s.sleep(1);
+	}
+}
+
+
+//sensor
+//A detector bit that comes on after a random gap, averaging gap, and stays on for hold
+static task sensor(scheduler& s, board& b, INT8U bit, INT32U gap, INT32U hold)
+{
+	for(;;)
+	{
+		co_await s.sleep(nextRandom(b) % (2 * gap));
+		b.inputs |= bit;
+		co_await s.sleep(hold);
+		b.inputs &= ~bit;
+	}
+}
+
+
+//replay
+//Steps a fresh controller through intersection 0's inputs, 0 if any greens differ
+static int replay(board& b, INT8U mode)
+{
+	ctl* c;
+	INT32U i;
+
+	c = ctlCreate();
+	ctlMode(mode);
+	for(i = 0; i < b.loggedInputs.size(); i++)
+	{
+		ctlStep(i + 1, b.loggedInputs[i]);
+		if(ctlGreens() != b.loggedGreens[i])
+		{
+			std::fprintf(stderr, "coro: intersection 0 differs from a direct run at tick %u\n", i + 1);
+			ctlFree(c);
+			return 0;
+		}
+	}
+
+	ctlFree(c);
+	return 1;
+}
+
+
+int main(int argc, char** argv)
+{
+	unsigned count,
+			seconds,
+			i;
+	INT8U mode,
+			app;
+	unsigned long long conflicts;
+	double wall;
+
+	count = argc > 1 ? std::atoi(argv[1]) : 20000;
+	seconds = argc > 2 ? std::atoi(argv[2]) : 60;
+	mode = argc > 3 ? std::atoi(argv[3]) : 0;
+
+	std::vector<board> boards(count);
+	scheduler* s = new scheduler;
+
+	for(i = 0; i < count; i++)
+	{
+		boards[i].c = ctlCreate();
+		if(boards[i].c == NULL)
+		{
+			std::fprintf(stderr, "coro: out of memory at intersection %u\n", i);
+			return 2;
+		}
+		ctlMode(mode);
+		boards[i].rng = 2463534242u ^ (i + 1) * 2654435761u;
+		boards[i].logging = i == 0;
+
+		s->spawn(controller(*s, boards[i]));
+		for(app = 0; app < NUM_APPROACHES; app++)
+			s->spawn(sensor(*s, boards[i], TURN_FLAG(app), TURN_GAP_TICKS, TURN_HOLD_TICKS));
+		s->spawn(sensor(*s, boards[i], AMB_FLAG(nextRandom(boards[i]) % NUM_APPROACHES), AMB_GAP_TICKS, AMB_HOLD_TICKS));
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	s->run(seconds * TICKS_PER_SEC);
+	wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	conflicts = 0;
+	for(board& b : boards)
+		conflicts += b.conflicts;
+
+	std::printf("%u intersections on 1 thread, %u s, mode %u\n", count, seconds, mode);
+	std::printf("wall %.2f s  %.1f x real time  %.0f ns per controller step\n",
+		wall, seconds / wall, wall * 1e9 / ((double)count * seconds * TICKS_PER_SEC));
+	std::printf("%llu coroutines, %.0f bytes of frame each, %u bytes of controller and ports each\n",
+		frames, (double)frameBytes / frames, ctlBytes());
+
+	if(conflicts)
+	{
+		std::fprintf(stderr, "coro: %llu ticks with a conflict fault\n", conflicts);
+		return 1;
+	}
+	if(!replay(boards[0], mode))
+		return 1;
+
+	delete s;
+	for(board& b : boards)
+		ctlFree(b.c);
+
+	return 0;
+}
@@ -0,0 +1,303 @@
+/*
+	Host side of the controller
+	
+	main.c is built here as it is. Its main() becomes targetMain() so
+	a tool can boot the controller and then step it under virtual time.
+*/
+#define main targetMain
+#include "../main.c"
+#undef main
+
+#include <stdlib.h>
+#include <string.h>
+#include "ctl.h"
+
+//ctl
+//An intersection and the board it runs on
+struct ctl{
+	intersection ix;
+	hostPorts ports;
+};
+
+
+//ctlBoot
+//main() stops after OSStart returns, which on the host is at once
+void ctlBoot(hostPorts* ports)
+{
+	hostPort = ports;
+	hostResetPorts(ports);
+	hostTick = 0;
+	
+	ix = &boardIntersection;
+	memset(ix, 0, sizeof(intersection));
+	
+	targetMain();
+}
+
+
+//ctlCreate
+//What main() does for the intersection, without the OS and the checkpoint
+ctl* ctlCreate(void)
+{
+	ctl* c;
+	
+	c = calloc(1, sizeof(ctl));
+	if(c == NULL)
+		return NULL;
+	
+	ctlSelect(c);
+	hostResetPorts(&c->ports);
+	hostTick = 0;
+	initIntersection();
+	
+	return c;
+}
+
+
+//ctlReset
+//In place, so a fuzzer can start every run from power on without a new process
+//The tick goes back to 0 too, for anything sent before the first ctlStep
+void ctlReset(ctl* c)
+{
+	ctlSelect(c);
+	memset(&c->ix, 0, sizeof(intersection));
+	hostResetPorts(&c->ports);
+	hostTick = 0;
+	initIntersection();
+}
+
+
+void ctlCopy(ctl* to, ctl* from)
+{
+	*to = *from;
+}
+
+
+void ctlFree(ctl* c)
+{
+	free(c);
+}
+
+
+unsigned ctlBytes(void)
+{
+	return sizeof(ctl);
+}
+
+
+void ctlSelect(ctl* c)
+{
+	ix = &c->ix;
+	hostPort = &c->ports;
+}
+
+
+hostPorts* ctlPorts(ctl* c)
+{
+	return &c->ports;
+}
+
+
+//ctlStep
+//What one pass of controllerTask does on the board
+void ctlStep(INT32U now, INT8U inputs)
+{
+	hostTick = now;
+	PORTA = inputs;
+	
+	controllerStep(now, PORTA);
+}
+
+
+//ctlSerial
+//What one pass of serialHandler does on the board, at the tick of the last ctlStep
+void ctlSerial(void)
+{
+	serialStep();
+}
+
+
+//ctlRxByte
+//What the SCI0 receiver does with a byte off the wire
+void ctlRxByte(INT8U data)
+{
+	hostPort->sci0drl = data;
+	SCI0SR1 |= SCI_RDRF;
+	sciRxIsr();
+}
+
+
+//ctlTelemetry
+void ctlTelemetry(INT8U* image)
+{
+	telemetryImage(image);
+}
+
+
+//ctlGreens
+//Read back from the ports, what a driver at the stop line sees
+INT8U ctlGreens(void)
+{
+	INT8U greens;
+	
+	greens = 0;
+	if(PORTB & LED_NORTH_GREEN)
+		greens |= LIGHT_NORTH;
+	if(PORTB & LED_SOUTH_GREEN)
+		greens |= LIGHT_SOUTH;
+	if(PTH & LED_EAST_GREEN)
+		greens |= LIGHT_EAST;
+	if(PTH & LED_WEST_GREEN)
+		greens |= LIGHT_WEST;
+	if(PORTB & LED_NORTH_TURN_GREEN)
+		greens |= TURN_NORTH;
+	if(PORTB & LED_SOUTH_TURN_GREEN)
+		greens |= TURN_SOUTH;
+	if(PTH & LED_EAST_TURN_GREEN)
+		greens |= TURN_EAST;
+	if(PTH & LED_WEST_TURN_GREEN)
+		greens |= TURN_WEST;
+	
+	return greens;
+}
+
+
+void ctlMode(INT8U mode)
+{
+	ix->phaseMode = mode;
+}
+
+
+//ctlConflict
+//Reads the LEDs back from the ports, like a cabinet conflict monitor
+//Returns the first rule broken
+INT8U ctlConflict(void)
+{
+	INT8U	active;		//Movements showing green or yellow, as light bits
+	INT8U	lit;		//Colours lit on one head
+	
+	//Through heads: exactly one of red, yellow and green
+	lit = !!(PORTB & LED_NORTH_RED) + !!(PTT & LED_NORTH_YELLOW) + !!(PORTB & LED_NORTH_GREEN);
+	if(lit != 1)
+		return FAULT_HEAD;
+	
+	lit = !!(PORTB & LED_SOUTH_RED) + !!(PTT & LED_SOUTH_YELLOW) + !!(PORTB & LED_SOUTH_GREEN);
+	if(lit != 1)
+		return FAULT_HEAD;
+	
+	lit = !!(PTH & LED_EAST_RED) + !!(PTT & LED_EAST_YELLOW) + !!(PTH & LED_EAST_GREEN);
+	if(lit != 1)
+		return FAULT_HEAD;
+	
+	lit = !!(PTH & LED_WEST_RED) + !!(PTT & LED_WEST_YELLOW) + !!(PTH & LED_WEST_GREEN);
+	if(lit != 1)
+		return FAULT_HEAD;
+	
+	//Turn heads have no red, they may be dark but not yellow and green
+	if(PTT & LED_NORTH_TURN_YELLOW && PORTB & LED_NORTH_TURN_GREEN)
+		return FAULT_HEAD;
+	if(PTT & LED_SOUTH_TURN_YELLOW && PORTB & LED_SOUTH_TURN_GREEN)
+		return FAULT_HEAD;
+	if(PTT & LED_EAST_TURN_YELLOW && PTH & LED_EAST_TURN_GREEN)
+		return FAULT_HEAD;
+	if(PTT & LED_WEST_TURN_YELLOW && PTH & LED_WEST_TURN_GREEN)
+		return FAULT_HEAD;
+	
+	//Collect the moving (green or yellow) movements
+	active = 0;
+	if(PORTB & LED_NORTH_GREEN || PTT & LED_NORTH_YELLOW)
+		active |= LIGHT_NORTH;
+	if(PORTB & LED_SOUTH_GREEN || PTT & LED_SOUTH_YELLOW)
+		active |= LIGHT_SOUTH;
+	if(PTH & LED_EAST_GREEN || PTT & LED_EAST_YELLOW)
+		active |= LIGHT_EAST;
+	if(PTH & LED_WEST_GREEN || PTT & LED_WEST_YELLOW)
+		active |= LIGHT_WEST;
+	if(PORTB & LED_NORTH_TURN_GREEN || PTT & LED_NORTH_TURN_YELLOW)
+		active |= TURN_NORTH;
+	if(PORTB & LED_SOUTH_TURN_GREEN || PTT & LED_SOUTH_TURN_YELLOW)
+		active |= TURN_SOUTH;
+	if(PTH & LED_EAST_TURN_GREEN || PTT & LED_EAST_TURN_YELLOW)
+		active |= TURN_EAST;
+	if(PTH & LED_WEST_TURN_GREEN || PTT & LED_WEST_TURN_YELLOW)
+		active |= TURN_WEST;
+	
+	//The two axes never move together
+	if(active & NS_MOVEMENTS && active & EW_MOVEMENTS)
+		return FAULT_CROSS;
+	
+	//A turn crosses the opposing through
+	if(active & TURN_NORTH && active & LIGHT_SOUTH)
+		return FAULT_OPPOSING;
+	if(active & TURN_SOUTH && active & LIGHT_NORTH)
+		return FAULT_OPPOSING;
+	if(active & TURN_EAST && active & LIGHT_WEST)
+		return FAULT_OPPOSING;
+	if(active & TURN_WEST && active & LIGHT_EAST)
+		return FAULT_OPPOSING;
+	
+	//Walk signals cross the other axis
+	if(PORTK & (LED_WALK_NS_WHITE) && active & EW_MOVEMENTS)
+		return FAULT_WALK;
+	if(PORTK & (LED_WALK_EW_WHITE) && active & NS_MOVEMENTS)
+		return FAULT_WALK;
+	
+	return FAULT_NONE;
+}
+
+
+//ctlStalled
+//The supervisor's check, without waiting for it to come round
+INT8U ctlStalled(INT32U now)
+{
+	INT8U stalled;
+	
+	stalled = 0;
+	if(!ix->preempted && now - ix->cyclePt.progress > CYCLE_STALL_TICKS)
+		stalled |= STALL_CYCLE;
+	if(now - ix->ambulancePt.progress > AMBULANCE_STALL_TICKS)
+		stalled |= STALL_AMBULANCE;
+	
+	return stalled;
+}
+
+
+//ctlStateKey
+//Lights, light change and preemption state and the line each thread waits at
+INT32U ctlStateKey(void)
+{
+	INT32U key;
+	
+	key = ix->ledState.lstate;
+	key = key * 31 + ix->yFlags;
+	key = key * 31 + ix->gFlags;
+	key = key * 31 + ix->lightsChanging;
+	key = key * 31 + (ix->preemptRequest | ix->preempted << 1);
+	key = key * 31 + ix->cyclePt.lc;
+	key = key * 31 + ix->ambulancePt.lc;
+	key = key * 31 + ix->cState.lstate;
+	
+	return key;
+}
+
+
+INT8U ctlGreensWaiting(void)
+{
+	return ix->lightsChanging ? ix->gFlags : 0;
+}
+
+
+void ctlMpcCounts(INT32U* decisions, INT32U* nodes, INT16U* budgetHits)
+{
+	*decisions = ix->ctrlMetrics.mpcDecisions;
+	*nodes = ix->ctrlMetrics.mpcNodesTotal;
+	*budgetHits = ix->ctrlMetrics.mpcBudgetHits;
+}
+
+
+//ctlReport
+//What the supervisor does every METRICS_REPORT_SECS
+void ctlReport(void)
+{
+	ix->reportDue = 1;
+}
@@ -0,0 +1,86 @@
+/*
+	Host interface to the controller
+	
+	ctl.c builds main.c as it is, with the stand-ins in includes.h,
+	and adds these for the host tools to drive it.
+	
+	A ctl is one intersection with its own board ports. Any number can
+	be created; calls go to the one last selected on the calling thread.
+	ctlBoot instead runs main() itself on the board's own intersection.
+*/
+#ifndef CTL_H
+#define CTL_H
+
+#include "host.h"
+
+typedef struct ctl ctl;
+
+//Safety rules ctlConflict checks the LEDs against
+#define FAULT_NONE		0
+#define FAULT_HEAD		1	//A signal head not showing exactly one colour
+#define FAULT_CROSS		2	//NS and EW movements at the same time
+#define FAULT_OPPOSING	3	//A turn against the opposing through
+#define FAULT_WALK		4	//A walk signal against moving traffic
+
+//ctlBoot:  Powers a board up and runs main() as far as starting the OS
+void ctlBoot(hostPorts* ports);
+
+//ctlCreate:  New intersection at power on, all red, and selects it, the thread's tick goes to 0
+ctl* ctlCreate(void);
+
+//ctlReset:  Puts an intersection back to power on, as ctlCreate left it, tick 0 included
+void ctlReset(ctl* c);
+
+//ctlCopy:  Copies an intersection and its board, to snapshot one or restore it
+void ctlCopy(ctl* to, ctl* from);
+
+//ctlFree:  Releases an intersection from ctlCreate
+void ctlFree(ctl* c);
+
+//ctlBytes:  Memory one intersection from ctlCreate takes, board ports included
+unsigned ctlBytes(void);
+
+//ctlSelect:  Makes c the intersection the calling thread works on
+void ctlSelect(ctl* c);
+
+//ctlPorts:  Board ports of an intersection
+hostPorts* ctlPorts(ctl* c);
+
+//ctlStep:  Runs one controller task tick at now with the sensor port showing inputs
+void ctlStep(INT32U now, INT8U inputs);
+
+//ctlSerial:  Runs one serial task tick, its console lines go to the console and its frames to sciTx
+void ctlSerial(void);
+
+//ctlReport:  Asks for the metrics and stack report, the next ctlSerial sends it
+void ctlReport(void);
+
+//ctlRxByte:  Receives a byte on SCI0, the interrupt queues it for the next ctlSerial
+//The receive buffer is the board's, so feed one intersection at a time
+void ctlRxByte(INT8U data);
+
+//ctlTelemetry:  The TELEM_FIELDS bytes the telemetry stream reports now
+void ctlTelemetry(INT8U* image);
+
+//ctlGreens:  Movements showing green on the LEDs, as LIGHT_ and TURN_ bits
+INT8U ctlGreens(void);
+
+//ctlMode:  Selects MODE_FIXED, MODE_PREDICTIVE or MODE_ADAPTIVE as CMD_MODE_SET would
+void ctlMode(INT8U mode);
+
+//ctlConflict:  First safety rule the LEDs break, FAULT_NONE if none
+INT8U ctlConflict(void);
+
+//ctlStalled:  Threads the supervisor would restart at now, as main.c's STALL_ bits, 0 if none
+INT8U ctlStalled(INT32U now);
+
+//ctlStateKey:  Where the state machines are, hashed, for coverage
+INT32U ctlStateKey(void);
+
+//ctlGreensWaiting:  Greens held back for an opposing yellow, 0 outside a light change
+INT8U ctlGreensWaiting(void);
+
+//ctlMpcCounts:  Predictive decisions so far, the search nodes they used and how many the budget cut short
+void ctlMpcCounts(INT32U* decisions, INT32U* nodes, INT16U* budgetHits);
+
+#endif
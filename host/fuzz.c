@@ -0,0 +1,361 @@
+/*
+	fuzz
+
+	In process fuzzer for the controller's state machines. Every run
+	starts from a saved controller, copied back in memory rather than a
+	new process, feeds it a timed sequence of sensor inputs and checks
+	the LEDs after every step:
+
+		- the safety rules of ctlConflict
+		- no thread waiting longer than the supervisor allows (ctlStalled)
+
+	Coverage is the transitions between controller states (ctlStateKey).
+	A run that reaches a new one keeps its input for mutation and the
+	controller it ended with as a start for later runs, so the search
+	goes deeper into the light cycle and the preemption paths with time.
+
+	Before the random runs, every mode is driven into a light change with
+	yellows running and greens waiting on them, and an ambulance is
+	raised from each direction at that tick.
+
+		fuzz [runs] [seed]
+
+	The same arguments always make the same runs. On a broken rule the
+	input and the tick are printed and the exit status is 1.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ctl.h"
+
+#define TICKS_PER_SEC		100
+
+//Sensor bits on PORTA
+#define TURN_BITS		0x0F
+#define AMB_FLAG(app)	(16 << (app))
+
+#define NUM_MODES		3
+
+//An input is up to MAX_EVENTS events of 2 bytes: ticks to wait / GAP_SCALE, then PORTA
+#define MAX_EVENTS		16
+#define GAP_SCALE		2
+
+//Ticks run after the last event so its effect shows
+#define TAIL_TICKS		(30 * TICKS_PER_SEC)
+
+//Controllers saved as starts, and inputs kept for mutation
+#define MAX_STARTS		2048
+#define MAX_INPUTS		2048
+
+//Transition coverage map, a power of 2
+#define MAP_BITS		(1 << 20)
+
+//Ambulance test: how long the ambulance is seen, and how long the run goes on after it
+#define AMB_HOLD_TICKS	(15 * TICKS_PER_SEC)
+#define AMB_AFTER_TICKS	(120 * TICKS_PER_SEC)
+
+
+//start type
+//A saved controller and the tick it was saved at
+typedef struct{
+	ctl* c;
+	INT32U tick;
+} start;
+
+//input type
+typedef struct{
+	INT8U len;
+	INT8U bytes[2 * MAX_EVENTS];
+} input;
+
+start starts[MAX_STARTS];
+int numStarts;
+
+input inputs[MAX_INPUTS];
+int numInputs;
+
+INT8U coverage[MAP_BITS / 8];
+INT32U edges;
+
+ctl* live;				//Controller being run
+INT32U rng = 2463534242u;
+unsigned long long steps;
+
+
+INT32U nextRandom(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+
+//check
+//Steps the live controller once and checks it, 0 if a rule was broken
+int check(INT32U now, INT8U porta, INT32U* key)
+{
+	INT32U next,
+			bit;
+	INT8U fault,
+			stalled;
+
+	ctlStep(now, porta);
+	steps++;
+
+	fault = ctlConflict();
+	stalled = ctlStalled(now);
+	if(fault != FAULT_NONE || stalled)
+	{
+		fprintf(stderr, "fuzz: %s %u at tick %u, PORTA %02X\n",
+			fault != FAULT_NONE ? "conflict" : "stalled thread", fault != FAULT_NONE ? fault : stalled,
+			now, porta);
+		return 0;
+	}
+
+	//Mark the transition
+	next = ctlStateKey();
+	if(next != *key)
+	{
+		bit = (next ^ (*key * 2654435761u)) & (MAP_BITS - 1);
+		if(!(coverage[bit / 8] & 1 << (bit % 8)))
+		{
+			coverage[bit / 8] |= 1 << (bit % 8);
+			edges++;
+		}
+		*key = next;
+	}
+
+	return 1;
+}
+
+
+//keepStart
+//Saves the live controller as a start, replacing a random one once full
+void keepStart(INT32U tick)
+{
+	int i;
+
+	if(numStarts < MAX_STARTS)
+	{
+		i = numStarts++;
+		starts[i].c = ctlCreate();
+	}
+	else
+		i = nextRandom() % MAX_STARTS;
+
+	ctlCopy(starts[i].c, live);
+	starts[i].tick = tick;
+	ctlSelect(live);
+}
+
+
+//mutate
+//New input from a kept one, or from nothing
+void mutate(input* in)
+{
+	int i,
+		n;
+
+	if(numInputs == 0 || nextRandom() % 8 == 0)
+	{
+		in->len = 2 + 2 * (nextRandom() % MAX_EVENTS);
+		for(i = 0; i < in->len; i++)
+			in->bytes[i] = nextRandom();
+		return;
+	}
+
+	*in = inputs[nextRandom() % numInputs];
+	n = 1 + nextRandom() % 4;
+	while(n--)
+	{
+		i = nextRandom() % in->len;
+		switch(nextRandom() % 5)
+		{
+			case 0:
+				in->bytes[i] = nextRandom();
+				break;
+
+			case 1:
+				in->bytes[i] ^= 1 << (nextRandom() % 8);
+				break;
+
+			//Ambulance bits are rare in random bytes' effect, set one on purpose
+			case 2:
+				in->bytes[i | 1] |= AMB_FLAG(nextRandom() % 4);
+				break;
+
+			case 3:
+				in->bytes[i & ~1] = nextRandom() % 4;
+				break;
+
+			//Grow by an event
+			default:
+				if(in->len < 2 * MAX_EVENTS)
+				{
+					in->bytes[in->len] = nextRandom();
+					in->bytes[in->len + 1] = nextRandom();
+					in->len += 2;
+				}
+				break;
+		}
+	}
+}
+
+
+//runInput
+//Runs an input from a start, 0 if a rule was broken
+int runInput(input* in, start* from)
+{
+	INT32U now,
+			end,
+			key,
+			before;
+	INT8U porta;
+	int i;
+
+	ctlCopy(live, from->c);
+	ctlSelect(live);
+	now = from->tick;
+	key = ctlStateKey();
+	before = edges;
+	porta = 0;
+
+	for(i = 0; i < in->len; i += 2)
+	{
+		end = now + in->bytes[i] * GAP_SCALE;
+		while(now < end)
+			if(!check(++now, porta, &key))
+				return 0;
+		porta = in->bytes[i + 1];
+	}
+
+	end = now + TAIL_TICKS;
+	while(now < end)
+		if(!check(++now, porta, &key))
+			return 0;
+
+	if(edges != before)
+	{
+		keepStart(now);
+		if(numInputs < MAX_INPUTS)
+			inputs[numInputs++] = *in;
+		else
+			inputs[nextRandom() % MAX_INPUTS] = *in;
+	}
+
+	return 1;
+}
+
+
+//ambulanceInYellow
+//Runs a mode until a light change has greens waiting on yellows, then an ambulance arrives
+//Returns the cases run, or -1 if a rule was broken
+int ambulanceInYellow(INT8U mode, INT8U app, INT32U seed)
+{
+	INT32U now,
+			end,
+			key;
+	INT8U porta;
+	int cases;
+
+	ctlReset(live);
+	ctlMode(mode);
+	rng = seed;
+	key = ctlStateKey();
+	porta = 0;
+	cases = 0;
+
+	//Several light changes per run, each one caught with greens waiting
+	for(now = 1; now < 3600 * TICKS_PER_SEC && cases < 8; now++)
+	{
+		if(nextRandom() % 500 == 0)
+			porta = nextRandom() & TURN_BITS;
+		if(!check(now, porta, &key))
+			return -1;
+
+		if(!ctlGreensWaiting())
+			continue;
+
+		//Keep it as a start, then let the ambulance in at this very tick
+		keepStart(now);
+		cases++;
+
+		end = now + AMB_HOLD_TICKS;
+		while(now < end)
+			if(!check(++now, porta | AMB_FLAG(app), &key))
+				return -1;
+
+		end = now + AMB_AFTER_TICKS;
+		while(now < end)
+			if(!check(++now, porta, &key))
+				return -1;
+	}
+
+	return cases;
+}
+
+
+int main(int argc, char** argv)
+{
+	unsigned long long runs,
+			run;
+	INT8U mode,
+			app;
+	int cases,
+		n,
+		i;
+	input in;
+	clock_t begin;
+	double secs;
+
+	runs = argc > 1 ? strtoull(argv[1], NULL, 10) : 20000;
+	if(argc > 2)
+		rng = strtoul(argv[2], NULL, 10) * 2654435761u + 1;
+
+	live = ctlCreate();
+	begin = clock();
+
+	//Power on in each mode is a start
+	for(mode = 0; mode < NUM_MODES; mode++)
+	{
+		ctlReset(live);
+		ctlMode(mode);
+		keepStart(0);
+	}
+
+	//The ambulance during a yellow with greens pending, from every direction in every mode
+	cases = 0;
+	for(mode = 0; mode < NUM_MODES; mode++)
+		for(app = 0; app < 4; app++)
+		{
+			n = ambulanceInYellow(mode, app, rng + mode * 4 + app);
+			if(n < 0)
+			{
+				fprintf(stderr, "fuzz: ambulance from approach %u in mode %u\n", app, mode);
+				return 1;
+			}
+			cases += n;
+		}
+
+	for(run = 0; run < runs; run++)
+	{
+		mutate(&in);
+		if(!runInput(&in, &starts[nextRandom() % numStarts]))
+		{
+			fprintf(stderr, "fuzz: run %llu, input", run);
+			for(i = 0; i < in.len; i++)
+				fprintf(stderr, " %02X", in.bytes[i]);
+			fprintf(stderr, "\n");
+			return 1;
+		}
+	}
+
+	secs = (double)(clock() - begin) / CLOCKS_PER_SEC;
+	printf("%d ambulance in yellow cases, %llu runs, %.0f runs/s, %.1f M steps/s\n",
+		cases, runs, runs / secs, steps / secs / 1e6);
+	printf("%u transitions covered, %d starts, %d inputs kept\n", edges, numStarts, numInputs);
+
+	return 0;
+}
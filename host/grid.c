@@ -0,0 +1,704 @@
+/*
+	grid
+
+	Vehicle level microsimulation of a square city grid. Every
+	intersection runs the controller from main.c, stepped every tick like
+	controllerTask does on the board, and sees the cars as the board would:
+	a turn detector bit while a car waits at the head of its turn lane and
+	an ambulance bit while an ambulance is queued or less than
+	AMB_DETECT_SECS out. Cars leave the stop line on green only, one per
+	headway after a start up delay, and drive the link to the next
+	intersection.
+
+	The grid is cut into strips of rows, one thread each. A car crossing
+	into another strip goes through a single producer, single consumer
+	ring to that strip's thread. No locks: each strip publishes the tick
+	it has finished, and a strip may only run tick T once its neighbours
+	have finished T - LOOKAHEAD_TICKS, so a car from next door is always
+	in the ring before it could reach a detector. Every intersection has
+	its own random numbers and every lane a single producer, so the same
+	run gives the same result on any number of threads.
+
+		grid [-n side] [-s seconds] [-r veh/h] [-m mode] [-t threads,...]
+
+	Runs the scenario once per thread count and reports how much faster
+	than real time each ran. The results must match between runs.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "ctl.h"
+
+#define TICKS_PER_SEC		100
+
+//Light bits, as main.c has them
+#define LIGHT_NORTH		8
+#define TURN_NORTH		128
+
+//Approaches, in the order of the sensor bits
+#define APP_NORTH		0
+#define APP_SOUTH		1
+#define APP_EAST		2
+#define APP_WEST		3
+#define NUM_APPROACHES	4
+
+//Sensor bits for an approach
+#define TURN_FLAG(app)	(1 << (app))
+#define AMB_FLAG(app)	(16 << (app))
+
+//Lanes of an approach
+#define LANE_THROUGH	0
+#define LANE_TURN		1
+
+//Vehicles a lane holds, stop line queue and link together, a power of 2
+#define LANE_SIZE		64
+
+//Link between intersections, 400 m at 50 km/h
+#define LINK_SECS		30
+#define LINK_TICKS		(LINK_SECS * TICKS_PER_SEC)
+
+//Time from green to the first car moving, and between cars after that
+#define LOST_TICKS		(2 * TICKS_PER_SEC)
+#define THROUGH_HEADWAY	(2 * TICKS_PER_SEC)
+#define TURN_HEADWAY		(5 * TICKS_PER_SEC / 2)
+
+//An ambulance is seen this far ahead of the stop line
+#define AMB_DETECT_SECS	10
+#define AMB_DETECT_TICKS	(AMB_DETECT_SECS * TICKS_PER_SEC)
+
+//How far a strip may run ahead of its neighbours
+#define LOOKAHEAD_TICKS	(LINK_TICKS - AMB_DETECT_TICKS)
+
+//One car in 5 turns left at its next intersection
+#define TURN_ONE_IN		5
+
+//One new vehicle in this many is an ambulance
+#define AMB_ONE_IN		5000
+
+//Trips are 1 to MAX_HOPS intersections long
+#define MAX_HOPS		8
+
+//Cars crossing between two strips in flight at once, a power of 2
+#define RING_SIZE		4096
+
+//Vehicle flags
+#define VEH_TURN		1	//Turns left at the next intersection
+#define VEH_AMBULANCE	2
+
+#define MAX_RUNS		16
+
+
+//vehicle type
+typedef struct{
+	INT32U arrive;	//Tick it reaches the stop line
+	INT32U born;	//Tick it entered the grid
+	INT8U hops;		//Intersections left to cross
+	INT8U links;	//Links driven, for the free flow time
+	INT8U flags;
+} vehicle;
+
+//lane type
+//Cars in arrival order, the head is at the stop line once its arrive has passed
+typedef struct{
+	vehicle v[LANE_SIZE];
+	INT32U head;		//Next to leave
+	INT32U tail;		//Next free
+	INT32U nextOut;		//Earliest tick the head may leave
+	INT16U ambulances;	//Ambulances in the lane
+} lane;
+
+//node type
+//One intersection
+typedef struct{
+	ctl* c;
+	lane lanes[NUM_APPROACHES][2];
+	INT8U greens;		//Greens at the last tick
+	INT32U rng;
+} node;
+
+//transfer type
+//A car for a lane in another strip
+typedef struct{
+	INT32U node;
+	INT8U app;
+	INT8U lane;
+	vehicle v;
+} transfer;
+
+//ring type
+//Single producer, single consumer, head only written by the producer and tail by the consumer
+typedef struct{
+	_Alignas(64) atomic_uint head;
+	_Alignas(64) atomic_uint tail;
+	transfer buf[RING_SIZE];
+} ring;
+
+//totals type
+//Results of a strip, summed for the run
+typedef struct{
+	unsigned long long trips;
+	unsigned long long delayTicks;	//Trip time over free flow
+	unsigned long long ambTrips;
+	unsigned long long ambDelayTicks;
+	unsigned long long spawned;
+	unsigned long long dropped;		//Found their lane full
+	unsigned long long conflicts;	//Ticks with a conflict fault showing
+} totals;
+
+//strip type
+//The rows one thread runs
+typedef struct strip{
+	_Alignas(64) atomic_uint done;	//Last tick finished
+	int first;					//First row
+	int rows;
+	ring* in[2];				//From the strip above, below
+	ring* out[2];				//To the strip above, below
+	struct strip* next[2];		//Strip above, below
+	totals t;
+	pthread_t thread;
+} strip;
+
+//Run settings
+int side = 100;
+INT32U endTick;
+INT32U spawnOneIn;		//Chance per tick of a new car on each link
+INT8U mode = 0;
+
+node* nodes;
+strip* strips;
+int numStrips;
+
+//Where a car from each approach goes: its exit direction for through and turn,
+//and the approach it comes in on next door
+//North is row 0, so a car coming from the north is heading for row + 1
+const int exitDx[NUM_APPROACHES][2] = {{0, 1}, {0, -1}, {-1, 0}, {1, 0}};
+const int exitDy[NUM_APPROACHES][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+const INT8U exitApp[NUM_APPROACHES][2] = {
+	{APP_NORTH, APP_WEST},
+	{APP_SOUTH, APP_EAST},
+	{APP_EAST, APP_NORTH},
+	{APP_WEST, APP_SOUTH}
+};
+
+
+//nextRandom
+//xorshift32, one stream per intersection
+INT32U nextRandom(node* n)
+{
+	n->rng ^= n->rng << 13;
+	n->rng ^= n->rng >> 17;
+	n->rng ^= n->rng << 5;
+	return n->rng;
+}
+
+
+//stripOf
+//Strip running a row
+int stripOf(int row)
+{
+	return (int)((long)row * numStrips / side);
+}
+
+
+//laneAdd
+//Appends a car, 0 if the lane is full
+int laneAdd(lane* l, vehicle* v)
+{
+	if(l->tail - l->head == LANE_SIZE)
+		return 0;
+
+	l->v[l->tail++ & (LANE_SIZE - 1)] = *v;
+	if(v->flags & VEH_AMBULANCE)
+		l->ambulances++;
+
+	return 1;
+}
+
+
+//ringPush
+//Waits for room, taking in this strip's own cars meanwhile so two strips
+//with full rings to each other cannot stall
+void drainRings(strip* s);
+void ringPush(strip* s, ring* r, transfer* t)
+{
+	unsigned head;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	while(head - atomic_load_explicit(&r->tail, memory_order_acquire) == RING_SIZE)
+	{
+		drainRings(s);
+		sched_yield();
+	}
+
+	r->buf[head & (RING_SIZE - 1)] = *t;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+
+//drainRings
+//Moves every car waiting in the rings into its lane
+void drainRings(strip* s)
+{
+	ring* r;
+	unsigned head,
+			tail;
+	int i;
+	transfer* t;
+
+	for(i = 0; i < 2; i++)
+	{
+		r = s->in[i];
+		if(r == NULL)
+			continue;
+
+		tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+		head = atomic_load_explicit(&r->head, memory_order_acquire);
+		while(tail != head)
+		{
+			t = &r->buf[tail & (RING_SIZE - 1)];
+			if(!laneAdd(&nodes[t->node].lanes[t->app][t->lane], &t->v))
+				s->t.dropped++;
+			tail++;
+		}
+		atomic_store_explicit(&r->tail, tail, memory_order_release);
+	}
+}
+
+
+//sendCar
+//Puts a car on the link into (x, y) from approach app, arriving at the end of the link
+void sendCar(strip* s, node* from, vehicle* v, int x, int y, INT8U app, INT32U now)
+{
+	transfer t;
+	int to;
+
+	v->arrive = now + LINK_TICKS;
+	v->links++;
+	v->flags &= ~VEH_TURN;
+	if(nextRandom(from) % TURN_ONE_IN == 0)
+		v->flags |= VEH_TURN;
+
+	t.node = y * side + x;
+	t.app = app;
+	t.lane = v->flags & VEH_TURN ? LANE_TURN : LANE_THROUGH;
+	t.v = *v;
+
+	to = stripOf(y);
+	if(to == s - strips)
+	{
+		if(!laneAdd(&nodes[t.node].lanes[app][t.lane], v))
+			s->t.dropped++;
+	}
+	else
+		ringPush(s, s->out[to < s - strips ? 0 : 1], &t);
+}
+
+
+//finishTrip
+//Adds a car that has left the grid or reached its destination to the totals
+void finishTrip(strip* s, vehicle* v, INT32U now)
+{
+	INT32U delay;
+
+	delay = now - v->born - v->links * LINK_TICKS;
+	s->t.trips++;
+	s->t.delayTicks += delay;
+	if(v->flags & VEH_AMBULANCE)
+	{
+		s->t.ambTrips++;
+		s->t.ambDelayTicks += delay;
+	}
+}
+
+
+//spawn
+//New cars join each link this intersection feeds, and each link into it from outside the grid
+void spawn(strip* s, node* n, int x, int y, INT32U now)
+{
+	vehicle v;
+	INT8U app;
+	int nx,
+		ny;
+
+	for(app = 0; app < NUM_APPROACHES; app++)
+	{
+		if(nextRandom(n) % spawnOneIn)
+			continue;
+
+		v.born = now;
+		v.links = 0;
+		v.hops = 1 + nextRandom(n) % MAX_HOPS;
+		v.flags = nextRandom(n) % AMB_ONE_IN == 0 ? VEH_AMBULANCE : 0;
+		s->t.spawned++;
+
+		//Heading away from here through the exit a through car from app uses
+		nx = x + exitDx[app][0];
+		ny = y + exitDy[app][0];
+		if(nx >= 0 && nx < side && ny >= 0 && ny < side)
+		{
+			sendCar(s, n, &v, nx, ny, app, now);
+			continue;
+		}
+
+		//No neighbour that way, so this is a way in from outside the grid,
+		//coming in on the opposite approach
+		sendCar(s, n, &v, x, y, app ^ 1, now);
+	}
+}
+
+
+//sensors
+//PORTA as the intersection's detectors would show it
+INT8U sensors(node* n, INT32U now)
+{
+	INT8U inputs,
+			app,
+			k;
+	lane* l;
+	INT32U i;
+
+	inputs = 0;
+	for(app = 0; app < NUM_APPROACHES; app++)
+	{
+		l = &n->lanes[app][LANE_TURN];
+		if(l->head != l->tail && (INT32S)(l->v[l->head & (LANE_SIZE - 1)].arrive - now) <= 0)
+			inputs |= TURN_FLAG(app);
+
+		for(k = 0; k < 2; k++)
+		{
+			l = &n->lanes[app][k];
+			if(!l->ambulances)
+				continue;
+
+			for(i = l->head; i != l->tail; i++)
+			{
+				if((INT32S)(l->v[i & (LANE_SIZE - 1)].arrive - now) > AMB_DETECT_TICKS)
+					break;
+				if(l->v[i & (LANE_SIZE - 1)].flags & VEH_AMBULANCE)
+				{
+					inputs |= AMB_FLAG(app);
+					break;
+				}
+			}
+		}
+	}
+
+	return inputs;
+}
+
+
+//discharge
+//Lets the head of each lane with a green go, one car per headway
+void discharge(strip* s, node* n, int x, int y, INT32U now)
+{
+	INT8U app,
+			k,
+			bit;
+	lane* l;
+	vehicle v;
+	int nx,
+		ny;
+
+	for(app = 0; app < NUM_APPROACHES; app++)
+	{
+		for(k = 0; k < 2; k++)
+		{
+			bit = k == LANE_TURN ? TURN_NORTH >> app : LIGHT_NORTH >> app;
+			if(!(n->greens & bit))
+				continue;
+
+			l = &n->lanes[app][k];
+			if(l->head == l->tail)
+				continue;
+
+			v = l->v[l->head & (LANE_SIZE - 1)];
+			if((INT32S)(v.arrive - now) > 0 || (INT32S)(l->nextOut - now) > 0)
+				continue;
+
+			l->head++;
+			if(v.flags & VEH_AMBULANCE)
+				l->ambulances--;
+			l->nextOut = now + (k == LANE_TURN ? TURN_HEADWAY : THROUGH_HEADWAY);
+
+			//Off the edge or at its destination, the trip is over
+			nx = x + exitDx[app][k];
+			ny = y + exitDy[app][k];
+			if(--v.hops == 0 || nx < 0 || nx >= side || ny < 0 || ny >= side)
+				finishTrip(s, &v, now);
+			else
+				sendCar(s, n, &v, nx, ny, exitApp[app][k], now);
+		}
+	}
+}
+
+
+//stepNode
+//One tick of an intersection: cars arrive, the controller runs, cars leave
+void stepNode(strip* s, int x, int y, INT32U now)
+{
+	node* n;
+	INT8U greens,
+			app,
+			k,
+			bit;
+
+	n = &nodes[y * side + x];
+	spawn(s, n, x, y, now);
+
+	ctlSelect(n->c);
+	ctlStep(now, sensors(n, now));
+	if(ctlConflict())
+		s->t.conflicts++;
+
+	//A lane that has just gone green loses the start up time
+	greens = ctlGreens();
+	for(app = 0; app < NUM_APPROACHES; app++)
+		for(k = 0; k < 2; k++)
+		{
+			bit = k == LANE_TURN ? TURN_NORTH >> app : LIGHT_NORTH >> app;
+			if(greens & bit & ~n->greens)
+				n->lanes[app][k].nextOut = now + LOST_TICKS;
+		}
+	n->greens = greens;
+
+	discharge(s, n, x, y, now);
+}
+
+
+//waitNeighbours
+//Holds tick now back until both neighbours are within LOOKAHEAD_TICKS
+void waitNeighbours(strip* s, INT32U now)
+{
+	int i;
+
+	for(i = 0; i < 2; i++)
+	{
+		if(s->next[i] == NULL)
+			continue;
+
+		while(atomic_load_explicit(&s->next[i]->done, memory_order_acquire) + LOOKAHEAD_TICKS < now)
+		{
+			drainRings(s);
+			sched_yield();
+		}
+	}
+}
+
+
+//runStrip
+//Thread body
+void* runStrip(void* arg)
+{
+	strip* s;
+	INT32U now;
+	int x,
+		y;
+
+	s = arg;
+	for(now = 1; now <= endTick; now++)
+	{
+		waitNeighbours(s, now);
+		drainRings(s);
+
+		for(y = s->first; y < s->first + s->rows; y++)
+			for(x = 0; x < side; x++)
+				stepNode(s, x, y, now);
+
+		atomic_store_explicit(&s->done, now, memory_order_release);
+	}
+
+	return NULL;
+}
+
+
+//setup
+//Powers every intersection up with empty streets and cuts the grid into strips
+int setup(int threads)
+{
+	int i;
+
+	nodes = calloc((size_t)side * side, sizeof(node));
+	if(nodes == NULL)
+		return 0;
+
+	for(i = 0; i < side * side; i++)
+	{
+		nodes[i].c = ctlCreate();
+		if(nodes[i].c == NULL)
+			return 0;
+		ctlMode(mode);
+		nodes[i].rng = 2463534242u ^ (INT32U)(i + 1) * 2654435761u;
+	}
+
+	numStrips = threads;
+	strips = calloc(numStrips, sizeof(strip));
+	for(i = 0; i < numStrips; i++)
+	{
+		strips[i].first = (int)(((long)i * side + numStrips - 1) / numStrips);
+		strips[i].rows = (int)(((long)(i + 1) * side + numStrips - 1) / numStrips) - strips[i].first;
+		strips[i].next[0] = i > 0 ? &strips[i - 1] : NULL;
+		strips[i].next[1] = i < numStrips - 1 ? &strips[i + 1] : NULL;
+
+		//One ring each way across every boundary
+		if(i > 0)
+		{
+			strips[i].out[0] = aligned_alloc(64, sizeof(ring));
+			strips[i - 1].out[1] = aligned_alloc(64, sizeof(ring));
+			atomic_init(&strips[i].out[0]->head, 0);
+			atomic_init(&strips[i].out[0]->tail, 0);
+			atomic_init(&strips[i - 1].out[1]->head, 0);
+			atomic_init(&strips[i - 1].out[1]->tail, 0);
+			strips[i - 1].in[1] = strips[i].out[0];
+			strips[i].in[0] = strips[i - 1].out[1];
+		}
+	}
+
+	return 1;
+}
+
+
+//teardown
+void teardown(void)
+{
+	int i;
+
+	for(i = 0; i < side * side; i++)
+		ctlFree(nodes[i].c);
+	for(i = 0; i < numStrips; i++)
+	{
+		free(strips[i].out[0]);
+		free(strips[i].out[1]);
+	}
+	free(nodes);
+	free(strips);
+}
+
+
+double seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+int main(int argc, char** argv)
+{
+	int threads[MAX_RUNS],
+		runs,
+		run,
+		i,
+		simSecs,
+		rate;
+	double start,
+			wall,
+			firstWall;
+	totals sum,
+			firstSum;
+	char* p;
+
+	simSecs = 600;
+	rate = 60;
+	runs = 1;
+	threads[0] = 1;
+
+	for(i = 1; i + 1 < argc; i += 2)
+	{
+		if(!strcmp(argv[i], "-n"))
+			side = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-s"))
+			simSecs = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-r"))
+			rate = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-m"))
+			mode = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-t"))
+		{
+			runs = 0;
+			for(p = argv[i + 1]; *p && runs < MAX_RUNS; p++)
+			{
+				threads[runs++] = atoi(p);
+				while(*p && *p != ',')
+					p++;
+				if(!*p)
+					break;
+			}
+		}
+		else
+		{
+			fprintf(stderr, "usage: grid [-n side] [-s seconds] [-r veh/h] [-m mode] [-t threads,...]\n");
+			return 2;
+		}
+	}
+
+	endTick = (INT32U)simSecs * TICKS_PER_SEC;
+	spawnOneIn = rate > 0 ? 3600 * TICKS_PER_SEC / rate : 0xFFFFFFFF;
+
+	printf("%dx%d grid, %d s, %d veh/h new on every link, mode %u\n", side, side, simSecs, rate, mode);
+	printf("threads  wall s  x real time  speedup  trips     mean delay s  ambulances  mean s\n");
+
+	firstWall = 0;
+	memset(&firstSum, 0, sizeof(firstSum));
+	for(run = 0; run < runs; run++)
+	{
+		if(threads[run] < 1 || threads[run] > side || !setup(threads[run]))
+		{
+			fprintf(stderr, "grid: cannot run %d threads on %d rows\n", threads[run], side);
+			return 2;
+		}
+
+		start = seconds();
+		for(i = 0; i < numStrips; i++)
+			pthread_create(&strips[i].thread, NULL, runStrip, &strips[i]);
+		for(i = 0; i < numStrips; i++)
+			pthread_join(strips[i].thread, NULL);
+		wall = seconds() - start;
+
+		memset(&sum, 0, sizeof(sum));
+		for(i = 0; i < numStrips; i++)
+		{
+			sum.trips += strips[i].t.trips;
+			sum.delayTicks += strips[i].t.delayTicks;
+			sum.ambTrips += strips[i].t.ambTrips;
+			sum.ambDelayTicks += strips[i].t.ambDelayTicks;
+			sum.spawned += strips[i].t.spawned;
+			sum.dropped += strips[i].t.dropped;
+			sum.conflicts += strips[i].t.conflicts;
+		}
+		if(run == 0)
+		{
+			firstWall = wall;
+			firstSum = sum;
+		}
+
+		printf("%7d  %6.2f  %11.1f  %7.2f  %-8llu  %12.1f  %-10llu  %6.1f\n",
+			numStrips, wall, simSecs / wall, firstWall / wall, sum.trips,
+			sum.trips ? sum.delayTicks / (double)sum.trips / TICKS_PER_SEC : 0.0,
+			sum.ambTrips,
+			sum.ambTrips ? sum.ambDelayTicks / (double)sum.ambTrips / TICKS_PER_SEC : 0.0);
+
+		teardown();
+
+		if(sum.conflicts)
+		{
+			fprintf(stderr, "grid: %llu ticks with a conflict fault\n", sum.conflicts);
+			return 1;
+		}
+
+		//Only a full lane, which depends on when a ring is drained, may change the outcome
+		if(!sum.dropped && !firstSum.dropped && memcmp(&sum, &firstSum, sizeof(sum)))
+		{
+			fprintf(stderr, "grid: %d threads gave a different result\n", numStrips);
+			return 1;
+		}
+		if(sum.dropped)
+			printf("         %llu cars found their lane full and were dropped\n", sum.dropped);
+	}
+
+	return 0;
+}
@@ -0,0 +1,84 @@
+/*
+	Host build of the controller
+	
+	What the host stand-ins for the board and uC/OS-II share with the tools
+	that drive the controller. main.c itself only sees includes.h.
+*/
+#ifndef HOST_H
+#define HOST_H
+
+//uC/OS-II types, sized as on the HCS12
+typedef unsigned char	INT8U;
+typedef signed char		INT8S;
+typedef unsigned short	INT16U;
+typedef signed short	INT16S;
+typedef unsigned int	INT32U;
+typedef signed int		INT32S;
+
+typedef INT8U OS_STK;
+
+typedef struct{
+	INT32U OSFree;
+	INT32U OSUsed;
+} OS_STK_DATA;
+
+//Bytes of SCI0 output kept for a tool to read, must be a power of 2
+#define HOST_SCI_TX_SIZE	4096
+
+//Real time a TCNT count stands for, the 4 us main.c sets the board's timer to
+#define HOST_TIMER_NS		4000
+
+//TSCR1 bits
+#define HOST_TSCR1_TEN		0x80
+
+//SCI0SR1 bits
+#define HOST_SCI_RDRF		0x20
+#define HOST_SCI_TDRE		0x80
+
+//hostPorts type
+//The HCS12 registers main.c uses, one set per simulated board
+typedef struct{
+	INT8U porta;
+	INT8U portb;
+	INT8U pth;
+	INT8U ptt;
+	INT8U portk;
+	INT8U ddra;
+	INT8U ddrb;
+	INT8U ddrh;
+	INT8U ddrk;
+	INT8U ddrt;
+	INT8U copctl;
+	INT8U armcop;
+	INT8U tscr1;
+	INT8U tscr2;
+	INT8U sci0sr1;
+	INT8U sci0cr2;
+	INT8U sci0drl;			//Byte received while RDRF is set, writes go to sciTx
+	INT8U sciTx[HOST_SCI_TX_SIZE];	//SCI0 output ring
+	INT32U sciTxHead;		//Bytes written so far
+} hostPorts;
+
+//Board the calling thread is running, and its OS tick
+//Thread local so each thread can run its own controllers
+//A tool sets hostPort before calling anything in main.c
+extern __thread hostPorts* hostPort;
+extern __thread INT32U hostTick;
+
+//Console output from printf and puts in main.c, dropped unless set
+extern int hostVerbose;
+
+//hostResetPorts:  Powers a board up, ports cleared and the transmitter ready
+void hostResetPorts(hostPorts* ports);
+
+//hostSciData:  Where the next SCI0 byte written goes
+INT8U* hostSciData(void);
+
+//hostTimer:  TCNT, counting real time once TSCR1 has enabled the timer
+INT16U hostTimer(void);
+
+//hostPrintf, hostPuts:  printf and puts as main.c sees them
+int hostPrintf(const char* format, ...);
+int hostPuts(const char* s);
+
+#endif
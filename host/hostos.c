@@ -0,0 +1,128 @@
+/*
+	Host stand-ins for uC/OS-II and the HCS12 registers
+	
+	Tasks are never run by these: a tool calls the controller's functions
+	itself, on its own thread, and sets hostTick as it goes.
+*/
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "host.h"
+
+__thread hostPorts* hostPort;
+__thread INT32U hostTick;
+
+int hostVerbose;
+
+
+//hostResetPorts
+//SCI0SR1 shows the transmitter empty so sciPutByte never waits
+void hostResetPorts(hostPorts* ports)
+{
+	memset(ports, 0, sizeof(*ports));
+	ports->sci0sr1 = HOST_SCI_TDRE;
+}
+
+
+//hostSciData
+//main.c only reads SCI0DRL in sciRxIsr, after it has seen RDRF
+//While RDRF is set the access is that read, and clears RDRF as on the board
+//Otherwise it is a write and lands in the ring
+INT8U* hostSciData(void)
+{
+	if(hostPort->sci0sr1 & HOST_SCI_RDRF)
+	{
+		hostPort->sci0sr1 &= ~HOST_SCI_RDRF;
+		return &hostPort->sci0drl;
+	}
+	
+	return &hostPort->sciTx[hostPort->sciTxHead++ & (HOST_SCI_TX_SIZE - 1)];
+}
+
+
+//hostTimer
+//Stopped until TSCR1 enables it, as on the board, then counting real time
+INT16U hostTimer(void)
+{
+	struct timespec now;
+	
+	if(!(hostPort->tscr1 & HOST_TSCR1_TEN))
+		return 0;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (INT16U)(((unsigned long long)now.tv_sec * 1000000000u + now.tv_nsec) / HOST_TIMER_NS);
+}
+
+
+int hostPrintf(const char* format, ...)
+{
+	va_list args;
+	int n;
+	
+	if(!hostVerbose)
+		return 0;
+	
+	va_start(args, format);
+	n = vprintf(format, args);
+	va_end(args);
+	
+	return n;
+}
+
+
+int hostPuts(const char* s)
+{
+	//main.c uses puts like the board's, without the extra newline
+	return hostVerbose ? fputs(s, stdout) : 0;
+}
+
+
+void OSInit(void)
+{
+}
+
+
+//Returns at once, the tool runs the tasks' work itself
+void OSStart(void)
+{
+}
+
+
+INT8U OSTaskCreateExt(void (*task)(void* pd), void* pdata, OS_STK* ptos, INT8U prio, INT16U id,
+	OS_STK* pbos, INT32U stkSize, void* pext, INT16U opt)
+{
+	return 0;
+}
+
+
+INT8U OSTaskDel(INT8U prio)
+{
+	return 0;
+}
+
+
+//No task stacks to check, the report shows nothing used
+INT8U OSTaskStkChk(INT8U prio, OS_STK_DATA* pdata)
+{
+	pdata->OSFree = 0;
+	pdata->OSUsed = 0;
+	return 0;
+}
+
+
+void OSTimeDly(INT16U ticks)
+{
+}
+
+
+INT8U OSTimeDlyHMSM(INT8U hours, INT8U minutes, INT8U seconds, INT16U milli)
+{
+	return 0;
+}
+
+
+INT32U OSTimeGet(void)
+{
+	return hostTick;
+}
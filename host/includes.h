@@ -0,0 +1,65 @@
+/*
+	Host stand-in for the board's includes.h
+	
+	Just enough of uC/OS-II and the HCS12 to build main.c unchanged with gcc.
+	Time is virtual: the tick only moves when the tool driving the
+	controller sets hostTick.
+*/
+#ifndef INCLUDES_H
+#define INCLUDES_H
+
+#include <stdio.h>
+#include "host.h"
+
+//CodeWarrior interrupt keyword and vector number, the host has neither
+#define interrupt
+#define VectorNumber_Vsci0
+
+//Each host thread runs its own intersections, see ix in main.c
+#define PER_THREAD		__thread
+
+//uC/OS-II
+#define OS_TICKS_PER_SEC		100
+#define OS_NO_ERR			0
+#define OS_TASK_OPT_STK_CHK	0x0001
+#define OS_TASK_OPT_STK_CLR	0x0002
+
+//One thread runs a controller at a time, there is nothing to lock out
+#define OS_ENTER_CRITICAL()
+#define OS_EXIT_CRITICAL()
+
+void OSInit(void);
+void OSStart(void);
+INT8U OSTaskCreateExt(void (*task)(void* pd), void* pdata, OS_STK* ptos, INT8U prio, INT16U id,
+	OS_STK* pbos, INT32U stkSize, void* pext, INT16U opt);
+INT8U OSTaskDel(INT8U prio);
+INT8U OSTaskStkChk(INT8U prio, OS_STK_DATA* pdata);
+void OSTimeDly(INT16U ticks);
+INT8U OSTimeDlyHMSM(INT8U hours, INT8U minutes, INT8U seconds, INT16U milli);
+INT32U OSTimeGet(void);
+
+//HCS12 registers
+#define PORTA		(hostPort->porta)
+#define PORTB		(hostPort->portb)
+#define PTH			(hostPort->pth)
+#define PTT			(hostPort->ptt)
+#define PORTK		(hostPort->portk)
+#define DDRA		(hostPort->ddra)
+#define DDRB		(hostPort->ddrb)
+#define DDRH		(hostPort->ddrh)
+#define DDRK		(hostPort->ddrk)
+#define DDRT		(hostPort->ddrt)
+#define COPCTL		(hostPort->copctl)
+#define ARMCOP		(hostPort->armcop)
+#define TSCR1		(hostPort->tscr1)
+#define TSCR2		(hostPort->tscr2)
+#define TCNT		(hostTimer())
+#define SCI0SR1		(hostPort->sci0sr1)
+#define SCI0CR2		(hostPort->sci0cr2)
+#define SCI0DRL		(*hostSciData())
+
+//Console output
+#define printf		hostPrintf
+#define puts		hostPuts
+
+#endif
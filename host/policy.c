@@ -0,0 +1,375 @@
+/*
+	policy
+
+	Benchmarks the phase selection modes against each other at one
+	intersection, over steady, asymmetric and shifting demand. Each
+	approach has a through lane and a turn lane with a detector, and cars
+	leave on green the way they do in grid and week: a start up delay,
+	then one per headway. The same cars arrive under every mode. A case
+	may shift to a second demand halfway through; the station sends each
+	demand's through veh/h with CMD_DEMAND_SET as it starts.
+
+		policy [seconds]
+
+	Reports the average delay per car of each mode in each case, and for
+	the predictive mode how many search nodes a decision took and how
+	long one node takes on this host. The predictive search has to finish
+	every decision inside its node budget, and adaptive mode has to beat
+	fixed on every case with one axis busier than the other, or the run
+	fails.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ctl.h"
+
+#define TICKS_PER_SEC		100
+#define TICKS_PER_HOUR		(3600 * TICKS_PER_SEC)
+
+//Light bits, as main.c has them
+#define LIGHT_NORTH		8
+#define TURN_NORTH		128
+
+#define NUM_APPROACHES	4
+#define TURN_FLAG(app)	(1 << (app))
+
+//Lanes of an approach
+#define LANE_THROUGH	0
+#define LANE_TURN		1
+
+//Cars a lane can hold, a power of 2
+#define LANE_SIZE		8192
+
+//Time from green to the first car moving, and between cars after that, as in grid
+#define LOST_TICKS		(2 * TICKS_PER_SEC)
+#define THROUGH_HEADWAY	(2 * TICKS_PER_SEC)
+#define TURN_HEADWAY		(5 * TICKS_PER_SEC / 2)
+
+//Phase selection modes, as CMD_MODE_SET takes them
+#define MODE_FIXED		0
+#define MODE_PREDICTIVE	1
+#define MODE_ADAPTIVE		2
+#define NUM_MODES		3
+
+//The serial protocol, as the README gives it
+#define PROTO_SYNC			0x7E
+#define PROTO_REPLY			0x80
+#define CMD_DEMAND_SET		0x09
+#define PROTO_ACK			0
+
+
+//lane type
+//Arrival ticks of the cars queued, in order
+typedef struct{
+	INT32U arrive[LANE_SIZE];
+	INT32U head;
+	INT32U tail;
+	INT32U nextOut;		//Earliest tick the head may leave
+	INT32U leftAt;		//Tick the last car left
+} lane;
+
+//demand type
+//Through and turn cars per hour on the N, S, E and W approaches
+typedef struct{
+	INT16U through[NUM_APPROACHES];
+	INT16U turn[NUM_APPROACHES];
+} demand;
+
+//demandCase type
+//Demand for the first half of the run and the second
+typedef struct{
+	const char* name;
+	demand half[2];
+	INT8U asymmetric;			//One axis busier than the other for some of the run
+} demandCase;
+
+//result type
+typedef struct{
+	unsigned long long cars;
+	double delay;				//Seconds, summed
+	INT32U maxQueue;
+	INT32U decisions;			//Predictive decisions
+	INT32U nodes;				//Search nodes they used
+	INT16U budgetHits;			//Decisions the node budget cut short
+	double decisionNs;			//Host time of the ticks a decision was made in
+} result;
+
+//The plan go greens are sized for 290 through veh/h on every approach
+#define LIGHT		{{150, 150, 150, 150}, {20, 20, 20, 20}}
+#define PLANNED		{{290, 290, 290, 290}, {45, 45, 45, 45}}
+#define HEAVY		{{450, 450, 450, 450}, {70, 70, 70, 70}}
+#define NS_MAJOR	{{500, 500, 100, 100}, {40, 40, 10, 10}}
+#define EW_MAJOR	{{100, 100, 500, 500}, {10, 10, 40, 40}}
+#define TURNS		{{200, 200, 200, 200}, {120, 40, 120, 40}}
+const demandCase cases[] = {
+	{"light",		{LIGHT, LIGHT},			0},
+	{"planned",		{PLANNED, PLANNED},		0},
+	{"heavy",		{HEAVY, HEAVY},			0},
+	{"turns heavy",	{TURNS, TURNS},			0},
+	{"NS major",	{NS_MAJOR, NS_MAJOR},	1},
+	{"NS to EW",	{NS_MAJOR, EW_MAJOR},	1},
+	{"rising",		{PLANNED, NS_MAJOR},	1}
+};
+#define NUM_CASES	(sizeof(cases) / sizeof(cases[0]))
+
+const char* modeNames[NUM_MODES] = {"fixed", "predictive", "adaptive"};
+
+ctl* cab;
+lane lanes[NUM_APPROACHES][2];
+INT32U rng;
+
+
+INT32U nextRandom(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+
+//command
+//Sends one frame through sciRxIsr and the serial task, returns 1 if it was acknowledged
+int command(INT8U cmd, INT8U* payload, INT8U len)
+{
+	hostPorts* p;
+	INT32U from;
+	INT8U sum;
+	int i;
+
+	p = ctlPorts(cab);
+	from = p->sciTxHead;
+
+	ctlRxByte(PROTO_SYNC);
+	ctlRxByte(len);
+	ctlRxByte(cmd);
+	sum = len + cmd;
+	for(i = 0; i < len; i++)
+	{
+		ctlRxByte(payload[i]);
+		sum += payload[i];
+	}
+	ctlRxByte((INT8U)(0 - sum));
+	ctlSerial();
+
+	//The reply is the first frame out, SYNC LEN CMD STATUS CHK
+	return p->sciTxHead - from >= 5
+		&& p->sciTx[(from + 2) & (HOST_SCI_TX_SIZE - 1)] == (cmd | PROTO_REPLY)
+		&& p->sciTx[(from + 3) & (HOST_SCI_TX_SIZE - 1)] == PROTO_ACK;
+}
+
+
+//setDemand
+//What a station that knows the through demand sends
+int setDemand(const demand* d)
+{
+	INT8U payload[2 * NUM_APPROACHES];
+	int app;
+
+	for(app = 0; app < NUM_APPROACHES; app++)
+	{
+		payload[2 * app] = d->through[app] >> 8;
+		payload[2 * app + 1] = d->through[app];
+	}
+	return command(CMD_DEMAND_SET, payload, sizeof(payload));
+}
+
+
+//elapsedNs
+double elapsedNs(struct timespec* from, struct timespec* to)
+{
+	return (to->tv_sec - from->tv_sec) * 1e9 + (to->tv_nsec - from->tv_nsec);
+}
+
+
+//leave
+void leave(result* r, INT32U arrive, INT32U now)
+{
+	r->cars++;
+	r->delay += (double)(now - arrive) / TICKS_PER_SEC;
+}
+
+
+//runCase
+//Returns 0 on a conflict fault or a refused command
+int runCase(const demandCase* dc, INT8U mode, INT32U seconds, result* r)
+{
+	INT8U greens,
+			lastGreens,
+			inputs,
+			app,
+			k,
+			bit;
+	INT32U now,
+			end,
+			perHour,
+			queued,
+			decisions;
+	struct timespec before,
+			after;
+	const demand* d;
+	lane* l;
+
+	ctlReset(cab);
+	ctlMode(mode);
+	memset(lanes, 0, sizeof(lanes));
+	memset(r, 0, sizeof(*r));
+	rng = 2463534242u;
+
+	lastGreens = 0;
+	end = seconds * TICKS_PER_SEC;
+	d = NULL;
+	for(now = 1; now <= end; now++)
+	{
+		//The demand of this half, sent as it starts
+		if(d != &dc->half[now > end / 2])
+		{
+			d = &dc->half[now > end / 2];
+			if(!setDemand(d))
+				return 0;
+		}
+
+		//Arrivals, the same under every mode
+		for(app = 0; app < NUM_APPROACHES; app++)
+			for(k = 0; k < 2; k++)
+			{
+				perHour = k == LANE_TURN ? d->turn[app] : d->through[app];
+				if(nextRandom() % TICKS_PER_HOUR >= perHour)
+					continue;
+				l = &lanes[app][k];
+				if(l->tail - l->head < LANE_SIZE)
+					l->arrive[l->tail++ & (LANE_SIZE - 1)] = now;
+			}
+
+		//A car at the head of a turn lane holds the detector
+		//It drops for the tick after a car leaves, while the next one pulls up,
+		//so the detector counts every car
+		inputs = 0;
+		for(app = 0; app < NUM_APPROACHES; app++)
+		{
+			l = &lanes[app][LANE_TURN];
+			if(l->head != l->tail && l->leftAt != now - 1)
+				inputs |= TURN_FLAG(app);
+		}
+
+		decisions = r->decisions;
+		clock_gettime(CLOCK_MONOTONIC, &before);
+		ctlStep(now, inputs);
+		clock_gettime(CLOCK_MONOTONIC, &after);
+		ctlSerial();
+		ctlMpcCounts(&r->decisions, &r->nodes, &r->budgetHits);
+		if(r->decisions != decisions)
+			r->decisionNs += elapsedNs(&before, &after);
+
+		if(ctlConflict())
+		{
+			fprintf(stderr, "policy: conflict fault %u at tick %u\n", ctlConflict(), now);
+			return 0;
+		}
+
+		//Departures, after the start up delay of a new green
+		greens = ctlGreens();
+		for(app = 0; app < NUM_APPROACHES; app++)
+			for(k = 0; k < 2; k++)
+			{
+				bit = k == LANE_TURN ? TURN_NORTH >> app : LIGHT_NORTH >> app;
+				l = &lanes[app][k];
+				if(greens & bit & ~lastGreens)
+					l->nextOut = now + LOST_TICKS;
+
+				queued = l->tail - l->head;
+				if(queued > r->maxQueue)
+					r->maxQueue = queued;
+
+				if(!(greens & bit) || !queued || (INT32S)(l->nextOut - now) > 0)
+					continue;
+
+				leave(r, l->arrive[l->head++ & (LANE_SIZE - 1)], now);
+				l->leftAt = now;
+				l->nextOut = now + (k == LANE_TURN ? TURN_HEADWAY : THROUGH_HEADWAY);
+			}
+		lastGreens = greens;
+	}
+
+	//Cars still waiting count with the delay they have had so far
+	for(app = 0; app < NUM_APPROACHES; app++)
+		for(k = 0; k < 2; k++)
+		{
+			l = &lanes[app][k];
+			while(l->head != l->tail)
+				leave(r, l->arrive[l->head++ & (LANE_SIZE - 1)], end);
+		}
+
+	return 1;
+}
+
+
+//delay
+double delay(result* r)
+{
+	return r->cars ? r->delay / r->cars : 0.0;
+}
+
+
+int main(int argc, char** argv)
+{
+	result results[NUM_MODES];
+	result* p;
+	INT32U seconds,
+			decisions,
+			nodes;
+	INT16U budgetHits;
+	double nodeNs;
+	unsigned i;
+	int failed;
+	INT8U mode;
+	clock_t begin;
+
+	seconds = argc > 1 ? atoi(argv[1]) : 3600;
+	cab = ctlCreate();
+	begin = clock();
+
+	printf("%u s per case, delay per car in s against fixed, predictive nodes per decision\n", seconds);
+	printf("%-12s %8s %17s %17s %8s %8s\n", "", "fixed", "predictive", "adaptive", "nodes", "ns/node");
+
+	decisions = 0;
+	nodes = 0;
+	budgetHits = 0;
+	nodeNs = 0;
+	failed = 0;
+	for(i = 0; i < NUM_CASES; i++)
+	{
+		for(mode = 0; mode < NUM_MODES; mode++)
+			if(!runCase(&cases[i], mode, seconds, &results[mode]))
+			{
+				fprintf(stderr, "policy: %s run in %s mode failed\n", cases[i].name, modeNames[mode]);
+				return 1;
+			}
+
+		p = &results[MODE_PREDICTIVE];
+		printf("%-12s %8.1f %8.1f %+7.1f%% %8.1f %+7.1f%% %8.1f %8.0f\n", cases[i].name,
+			delay(&results[MODE_FIXED]),
+			delay(p), 100.0 * (delay(p) / delay(&results[MODE_FIXED]) - 1),
+			delay(&results[MODE_ADAPTIVE]), 100.0 * (delay(&results[MODE_ADAPTIVE]) / delay(&results[MODE_FIXED]) - 1),
+			p->decisions ? (double)p->nodes / p->decisions : 0.0,
+			p->nodes ? p->decisionNs / p->nodes : 0.0);
+
+		decisions += p->decisions;
+		nodes += p->nodes;
+		budgetHits += p->budgetHits;
+		nodeNs += p->decisionNs;
+
+		if(cases[i].asymmetric && delay(&results[MODE_ADAPTIVE]) >= delay(&results[MODE_FIXED]))
+		{
+			fprintf(stderr, "policy: adaptive mode no better than fixed on %s\n", cases[i].name);
+			failed = 1;
+		}
+	}
+
+	printf("%u predictive decisions, %.1f nodes each, %u cut short by the node budget, %.0f ns/node on this host, %.1f s\n",
+		decisions, decisions ? (double)nodes / decisions : 0.0, budgetHits, nodes ? nodeNs / nodes : 0.0,
+		(double)(clock() - begin) / CLOCKS_PER_SEC);
+
+	return failed || budgetHits ? 1 : 0;
+}
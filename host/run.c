@@ -0,0 +1,54 @@
+/*
+	run
+	
+	Runs one controller under virtual time with random sensor input and
+	its console output on stdout. Stops with an error on a conflict fault.
+	
+		run [seconds] [seed] [mode]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "ctl.h"
+
+#define TICKS_PER_SEC	100
+
+
+int main(int argc, char** argv)
+{
+	hostPorts ports;
+	INT32U seconds,
+			tick;
+	INT8U inputs;
+	
+	seconds = argc > 1 ? atol(argv[1]) : 600;
+	srand(argc > 2 ? atoi(argv[2]) : 1);
+	
+	hostVerbose = 1;
+	ctlBoot(&ports);
+	
+	if(argc > 3)
+		ctlMode(atoi(argv[3]));
+	
+	//Turn calls come and go, now and then an ambulance approaches for a few seconds
+	inputs = 0;
+	for(tick = 1; tick <= seconds * TICKS_PER_SEC; tick++)
+	{
+		if(rand() % 3000 == 0)
+			inputs = (inputs & 0xF0) | (rand() & 0x0F);
+		if(rand() % 20000 == 0)
+			inputs |= 0x10 << (rand() % 4);
+		if(rand() % 500 == 0)
+			inputs &= 0x0F;
+		
+		ctlStep(tick, inputs);
+		ctlSerial();
+		
+		if(ctlConflict())
+		{
+			fprintf(stderr, "run: conflict fault %u at tick %u\n", ctlConflict(), tick);
+			return 1;
+		}
+	}
+	
+	return 0;
+}
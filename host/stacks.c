@@ -0,0 +1,325 @@
+/*
+	stacks
+
+	Stack high water marks of the controller and serial tasks on a host
+	build. Each task's work runs on a painted stack of its own, switched
+	to with ucontext, and the paint left untouched gives the deepest it
+	went, as the supervisor's STACK report does on the board.
+
+	The controller runs every mode in turn with random turn calls and
+	ambulances. Between its ticks a station sends every command, a full
+	bins reply and a geometry upload among them, and asks for the metrics
+	report now and then. The report gives each task's mark and what it was
+	doing when it made it.
+
+		stacks [seconds per mode]
+
+	The marks are main.c's own frames with x86-64 sizes. The C library's
+	printf and the tick interrupt are not in them, and the supervisor's
+	deepest call is into the kernel, which the host only stubs. They show
+	which work is deepest and how the tasks compare; the board's sizes come
+	from its STACK report after a soak run. Fails if main.c's frames alone
+	already fill a board stack.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include "ctl.h"
+
+#define TICKS_PER_SEC	100
+
+//Host stack per task, far more than any task needs
+#define HOST_STK_SIZE	65536
+#define PAINT			0xA5
+
+//Bytes each task has on the board, as main.c sizes them
+#define BOARD_STK_SIZE	1024
+
+#define NUM_MODES		3
+
+//The serial protocol, as the README gives it
+#define PROTO_SYNC			0x7E
+#define CMD_PLAN_UPLOAD		0x01
+#define CMD_PLAN_QUERY		0x02
+#define CMD_PLAN_STORE		0x03
+#define CMD_SCHEDULE_SET	0x04
+#define CMD_CLOCK_SET		0x05
+#define CMD_BINS_GET		0x06
+#define CMD_MODE_SET		0x07
+#define CMD_GEOMETRY_SET	0x08
+#define CMD_DEMAND_SET		0x09
+#define NUM_COMMANDS		9
+
+#define TASK_CONTROLLER	0
+#define TASK_SERIAL		1
+#define NUM_TASKS			2
+
+
+//hostStack type
+//A painted stack and the deepest any work has gone into it
+typedef struct{
+	const char* name;
+	INT8U* base;
+	unsigned entry;			//Bytes the switch onto the stack takes by itself
+	unsigned mark;			//Deepest seen, less entry
+	char deepest[64];		//What the task was doing at the deepest
+} hostStack;
+
+hostStack stacks[NUM_TASKS] = {
+	{"CONTROLLER"},
+	{"SERIAL"}
+};
+
+ucontext_t toolContext;
+ucontext_t taskContext;
+void (*work)(void);
+
+//Controller step arguments, globals so work can take none
+INT32U stepNow;
+INT8U stepInputs;
+
+INT32U rng = 2463534242u;
+
+
+INT32U nextRandom(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+
+//used
+//Bytes from the top of a stack down to the lowest one written
+unsigned used(hostStack* s)
+{
+	unsigned i;
+
+	for(i = 0; i < HOST_STK_SIZE && s->base[i] == PAINT; i++)
+		;
+	return HOST_STK_SIZE - i;
+}
+
+
+//runOn
+//Runs fn on a task's stack and notes a new high water mark with what made it
+void runOn(int task, void (*fn)(void), const char* doing)
+{
+	hostStack* s;
+	unsigned depth;
+
+	s = &stacks[task];
+	work = fn;
+	getcontext(&taskContext);
+	taskContext.uc_stack.ss_sp = s->base;
+	taskContext.uc_stack.ss_size = HOST_STK_SIZE;
+	taskContext.uc_link = &toolContext;
+	makecontext(&taskContext, (void (*)(void))work, 0);
+	swapcontext(&toolContext, &taskContext);
+
+	depth = used(s);
+	if(depth > s->entry + s->mark)
+	{
+		s->mark = depth - s->entry;
+		snprintf(s->deepest, sizeof(s->deepest), "%s", doing);
+	}
+}
+
+
+void nothing(void)
+{
+}
+
+
+void step(void)
+{
+	ctlStep(stepNow, stepInputs);
+}
+
+
+//frame
+//Puts a command frame into the receive buffer, as sciRxIsr would between ticks
+void frame(INT8U cmd, INT8U* payload, INT8U len)
+{
+	INT8U sum;
+	int i;
+
+	ctlRxByte(PROTO_SYNC);
+	ctlRxByte(len);
+	ctlRxByte(cmd);
+	sum = len + cmd;
+	for(i = 0; i < len; i++)
+	{
+		ctlRxByte(payload[i]);
+		sum += payload[i];
+	}
+	ctlRxByte((INT8U)(0 - sum));
+}
+
+
+//command
+//One of every command in turn, with a valid payload, returns its name
+const char* command(int n, INT8U mode)
+{
+	static const INT16U plan[5] = {3000, 2000, 12000, 6000, 7000};
+	INT8U payload[48];
+	int i;
+
+	for(i = 0; i < 5; i++)
+	{
+		payload[1 + 2 * i] = plan[i] >> 8;
+		payload[2 + 2 * i] = plan[i];
+	}
+
+	switch(n)
+	{
+		case 0:
+			frame(CMD_PLAN_UPLOAD, payload + 1, 10);
+			return "CMD_PLAN_UPLOAD";
+
+		case 1:
+			frame(CMD_PLAN_QUERY, payload, 0);
+			return "CMD_PLAN_QUERY";
+
+		case 2:
+			payload[0] = 1;
+			frame(CMD_PLAN_STORE, payload, 11);
+			return "CMD_PLAN_STORE";
+
+		//Twelve entries, the most a schedule takes, each 15 minutes after the last
+		case 3:
+			for(i = 0; i < 12; i++)
+			{
+				payload[4 * i] = 0x7F;
+				payload[4 * i + 1] = i & 3;
+				payload[4 * i + 2] = (i * 15) >> 8;
+				payload[4 * i + 3] = i * 15;
+			}
+			frame(CMD_SCHEDULE_SET, payload, 48);
+			return "CMD_SCHEDULE_SET";
+
+		case 4:
+			payload[0] = 1;
+			payload[1] = 0;
+			payload[2] = 0;
+			frame(CMD_CLOCK_SET, payload, 3);
+			return "CMD_CLOCK_SET";
+
+		//Every one minute bin there is
+		case 5:
+			payload[0] = 0;
+			payload[1] = 0;
+			payload[2] = 255;
+			frame(CMD_BINS_GET, payload, 3);
+			return "CMD_BINS_GET";
+
+		//The mode the run is in, so the run stays in it
+		case 6:
+			payload[0] = mode;
+			frame(CMD_MODE_SET, payload, 1);
+			return "CMD_MODE_SET";
+
+		//40 mph on the level, 60 ft to clear, for every movement
+		case 7:
+			for(i = 0; i < 8; i++)
+			{
+				payload[3 * i] = 40;
+				payload[3 * i + 1] = 0;
+				payload[3 * i + 2] = 60;
+			}
+			frame(CMD_GEOMETRY_SET, payload, 24);
+			return "CMD_GEOMETRY_SET";
+
+		default:
+			for(i = 0; i < 4; i++)
+			{
+				payload[2 * i] = 0x01;
+				payload[2 * i + 1] = 0x2C;
+			}
+			frame(CMD_DEMAND_SET, payload, 8);
+			return "CMD_DEMAND_SET";
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	const char* modeNames[NUM_MODES] = {"fixed", "predictive", "adaptive"};
+	char doing[64];
+	const char* sent;
+	unsigned seconds;
+	INT32U now;
+	INT8U mode,
+			inputs;
+	int i,
+		failed;
+	ctl* c;
+
+	seconds = argc > 1 ? atoi(argv[1]) : 600;
+
+	for(i = 0; i < NUM_TASKS; i++)
+	{
+		stacks[i].base = malloc(HOST_STK_SIZE);
+		memset(stacks[i].base, PAINT, HOST_STK_SIZE);
+
+		//What the switch itself takes, so the marks are the work's alone
+		runOn(i, nothing, "");
+		stacks[i].entry = used(&stacks[i]);
+		stacks[i].mark = 0;
+	}
+
+	c = ctlCreate();
+	for(mode = 0; mode < NUM_MODES; mode++)
+	{
+		ctlReset(c);
+		ctlMode(mode);
+		inputs = 0;
+
+		for(now = 1; now <= seconds * TICKS_PER_SEC; now++)
+		{
+			//Turn calls come and go, now and then an ambulance approaches for a few seconds
+			if(nextRandom() % 1500 == 0)
+				inputs = (inputs & 0xF0) | (nextRandom() & 0x0F);
+			if(nextRandom() % 20000 == 0)
+				inputs |= 0x10 << (nextRandom() % 4);
+			if(nextRandom() % 500 == 0)
+				inputs &= 0x0F;
+
+			stepNow = now;
+			stepInputs = inputs;
+			snprintf(doing, sizeof(doing), "a step in %s mode", modeNames[mode]);
+			runOn(TASK_CONTROLLER, step, doing);
+
+			//A command every 10 s, and the metrics report every minute as the supervisor asks
+			sent = NULL;
+			if(now % (10 * TICKS_PER_SEC) == 0)
+				sent = command(now / (10 * TICKS_PER_SEC) % NUM_COMMANDS, mode);
+			if(now % (60 * TICKS_PER_SEC) == 0)
+			{
+				ctlReport();
+				sent = sent ? "a command and the metrics report" : "the metrics report";
+			}
+			snprintf(doing, sizeof(doing), "%s in %s mode", sent ? sent : "telemetry", modeNames[mode]);
+			runOn(TASK_SERIAL, ctlSerial, doing);
+		}
+	}
+
+	printf("%u s in each mode, main.c's own stack use on this host\n", seconds);
+	failed = 0;
+	for(i = 0; i < NUM_TASKS; i++)
+	{
+		printf("STACK %s %u bytes, deepest on %s\n", stacks[i].name, stacks[i].mark, stacks[i].deepest);
+		if(stacks[i].mark >= BOARD_STK_SIZE)
+		{
+			fprintf(stderr, "stacks: %s already fills the %u bytes it has on the board\n",
+				stacks[i].name, BOARD_STK_SIZE);
+			failed = 1;
+		}
+	}
+	printf("STACK SUPERVISOR not measured, its deepest call is into the kernel\n");
+
+	ctlFree(c);
+	return failed;
+}
@@ -0,0 +1,301 @@
+/*
+	telem
+
+	Central monitoring aggregator for the telemetry stream. Runs many
+	controllers under virtual time with random sensor input, each with
+	its serial task, and ingests every byte they send on SCI0 the way a
+	central station would: frame by frame, knowing only the protocol.
+	It keeps a view of every intersection's image from the keyframes and
+	deltas, and marks a view stale after a gap in the sequence numbers
+	until the next keyframe.
+
+	After every tick each view that is not stale must equal what its
+	controller would report now. A lossy backhaul can be simulated by
+	dropping whole frames. A view then goes on showing the image before
+	the lost frame until the next frame shows the gap, so with loss the
+	ticks a view is wrong without knowing it are only reported.
+
+		telem [controllers] [seconds] [mode] [loss %]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ctl.h"
+
+#define TICKS_PER_SEC	100
+
+//The serial protocol and telemetry frames, as the README gives them
+#define PROTO_SYNC			0x7E
+#define PROTO_MAX_PAYLOAD	48
+#define PROTO_OVERHEAD		4
+
+#define TELEM_KEYFRAME	0x40
+#define TELEM_DELTA		0x41
+#define TELEM_BIT		0x42
+
+#define TELEM_FIELDS		8
+
+//Frame parser states
+#define RX_SYNC		0
+#define RX_LEN		1
+#define RX_CMD		2
+#define RX_PAYLOAD	3
+#define RX_CHK		4
+
+
+//feed type
+//One controller's stream and what the aggregator has made of it
+typedef struct{
+	ctl* c;
+	INT8U inputs;
+	INT32U rng;
+	INT32U read;			//sciTx bytes taken so far
+
+	//Frame being received
+	INT8U rxState;
+	INT8U rxLen;
+	INT8U rxCmd;
+	INT8U rxGot;
+	INT8U rxSum;
+	INT8U rxPayload[PROTO_MAX_PAYLOAD];
+
+	//View
+	INT8U image[TELEM_FIELDS];
+	INT8U seq;
+	INT8U synced;			//A keyframe has come and no frame has gone missing since
+} feed;
+
+//Totals over every feed
+typedef struct{
+	unsigned long long bytes;
+	unsigned long long frames[3];
+	unsigned long long lost;
+	unsigned long long badFrames;
+	unsigned long long staleTicks;
+	unsigned long long mismatches;
+} totals;
+
+totals tot;
+unsigned lossPct;
+INT32U lossRng = 2463534242u;
+
+
+//nextRandom
+//xorshift32
+INT32U nextRandom(INT32U* rng)
+{
+	*rng ^= *rng << 13;
+	*rng ^= *rng >> 17;
+	*rng ^= *rng << 5;
+	return *rng;
+}
+
+
+//applyFrame
+//Brings the view up to date with a telemetry frame
+void applyFrame(feed* f)
+{
+	INT8U* p;
+	INT8U i,
+			n;
+
+	p = f->rxPayload;
+	if(f->rxCmd < TELEM_KEYFRAME || f->rxCmd > TELEM_BIT || f->rxLen < 2)
+		return;
+
+	//The backhaul loses the frame
+	if(lossPct && nextRandom(&lossRng) % 100 < lossPct)
+	{
+		tot.lost++;
+		return;
+	}
+
+	tot.frames[f->rxCmd - TELEM_KEYFRAME]++;
+	tot.bytes += f->rxLen + PROTO_OVERHEAD;
+
+	if(f->rxCmd == TELEM_KEYFRAME)
+	{
+		if(f->rxLen != 1 + TELEM_FIELDS)
+		{
+			tot.badFrames++;
+			return;
+		}
+		memcpy(f->image, p + 1, TELEM_FIELDS);
+		f->seq = p[0];
+		f->synced = 1;
+		return;
+	}
+
+	//A delta only applies to the image right before it
+	if(!f->synced || p[0] != (INT8U)(f->seq + 1))
+	{
+		f->synced = 0;
+		return;
+	}
+	f->seq = p[0];
+
+	if(f->rxCmd == TELEM_BIT)
+	{
+		if((p[1] >> 3) >= TELEM_FIELDS)
+		{
+			tot.badFrames++;
+			f->synced = 0;
+			return;
+		}
+		f->image[p[1] >> 3] ^= 1 << (p[1] & 7);
+		return;
+	}
+
+	n = 0;
+	for(i = 0; i < TELEM_FIELDS; i++)
+		if(p[1] & (1 << i))
+		{
+			if(2 + n >= f->rxLen)
+			{
+				tot.badFrames++;
+				f->synced = 0;
+				return;
+			}
+			f->image[i] ^= p[2 + n++];
+		}
+}
+
+
+//rxByte
+//Frame parser, one byte at a time, back to looking for SYNC on anything wrong
+void rxByte(feed* f, INT8U data)
+{
+	switch(f->rxState)
+	{
+		case RX_SYNC:
+			if(data == PROTO_SYNC)
+				f->rxState = RX_LEN;
+			break;
+
+		case RX_LEN:
+			f->rxLen = data;
+			f->rxSum = data;
+			f->rxGot = 0;
+			f->rxState = data <= PROTO_MAX_PAYLOAD ? RX_CMD : RX_SYNC;
+			break;
+
+		case RX_CMD:
+			f->rxCmd = data;
+			f->rxSum += data;
+			f->rxState = f->rxLen ? RX_PAYLOAD : RX_CHK;
+			break;
+
+		case RX_PAYLOAD:
+			f->rxPayload[f->rxGot++] = data;
+			f->rxSum += data;
+			if(f->rxGot == f->rxLen)
+				f->rxState = RX_CHK;
+			break;
+
+		case RX_CHK:
+			if((INT8U)(f->rxSum + data) == 0)
+				applyFrame(f);
+			else
+				tot.badFrames++;
+			f->rxState = RX_SYNC;
+			break;
+	}
+}
+
+
+//ingest
+//Takes what a controller has sent since the last call
+void ingest(feed* f)
+{
+	hostPorts* p;
+
+	p = ctlPorts(f->c);
+	if(p->sciTxHead - f->read > HOST_SCI_TX_SIZE)
+	{
+		fprintf(stderr, "telem: sciTx overrun\n");
+		exit(2);
+	}
+
+	while(f->read != p->sciTxHead)
+		rxByte(f, p->sciTx[f->read++ & (HOST_SCI_TX_SIZE - 1)]);
+}
+
+
+int main(int argc, char** argv)
+{
+	unsigned count,
+			seconds,
+			i;
+	INT32U now;
+	INT8U mode,
+			image[TELEM_FIELDS];
+	feed* feeds;
+	feed* f;
+	unsigned long long frames;
+	clock_t begin;
+	double wall;
+
+	count = argc > 1 ? atoi(argv[1]) : 1000;
+	seconds = argc > 2 ? atoi(argv[2]) : 600;
+	mode = argc > 3 ? atoi(argv[3]) : 0;
+	lossPct = argc > 4 ? atoi(argv[4]) : 0;
+
+	feeds = calloc(count, sizeof(feed));
+	for(i = 0; i < count; i++)
+	{
+		feeds[i].c = ctlCreate();
+		ctlMode(mode);
+		feeds[i].rng = 2463534242u ^ (i + 1) * 2654435761u;
+	}
+
+	begin = clock();
+	for(now = 1; now <= seconds * TICKS_PER_SEC; now++)
+	{
+		for(i = 0; i < count; i++)
+		{
+			f = &feeds[i];
+
+			//Turn calls come and go, now and then an ambulance approaches for a few seconds
+			if(nextRandom(&f->rng) % 3000 == 0)
+				f->inputs = (f->inputs & 0xF0) | (nextRandom(&f->rng) & 0x0F);
+			if(nextRandom(&f->rng) % 20000 == 0)
+				f->inputs |= 0x10 << (nextRandom(&f->rng) % 4);
+			if(nextRandom(&f->rng) % 500 == 0)
+				f->inputs &= 0x0F;
+
+			ctlSelect(f->c);
+			ctlStep(now, f->inputs);
+			ctlSerial();
+			ingest(f);
+
+			if(!f->synced)
+			{
+				tot.staleTicks++;
+				continue;
+			}
+			ctlTelemetry(image);
+			if(memcmp(image, f->image, TELEM_FIELDS))
+				tot.mismatches++;
+		}
+	}
+	wall = (double)(clock() - begin) / CLOCKS_PER_SEC;
+
+	frames = tot.frames[0] + tot.frames[1] + tot.frames[2];
+	printf("%u controllers, %u s, mode %u, %u%% of frames lost\n", count, seconds, mode, lossPct);
+	printf("%llu frames: %llu keyframes, %llu deltas, %llu single bits, %llu lost, %llu bad\n",
+		frames, tot.frames[0], tot.frames[1], tot.frames[2], tot.lost, tot.badFrames);
+	printf("%.2f bytes/update  %.2f bytes/s per controller\n",
+		frames ? (double)tot.bytes / frames : 0.0, (double)tot.bytes / count / seconds);
+	printf("views stale %.3f%% of ticks, wrong and not stale %.3f%%, wall %.2f s, %.0f frames/s ingested\n",
+		100.0 * tot.staleTicks / ((double)count * seconds * TICKS_PER_SEC),
+		100.0 * tot.mismatches / ((double)count * seconds * TICKS_PER_SEC), wall, frames / wall);
+
+	if((tot.mismatches && !lossPct) || tot.badFrames)
+	{
+		fprintf(stderr, "telem: %llu ticks with a view that does not match its controller\n", tot.mismatches);
+		return 1;
+	}
+
+	return 0;
+}
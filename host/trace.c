@@ -0,0 +1,400 @@
+/*
+	trace
+
+	Golden trace regression check. Runs the controller under virtual time
+	through each scenario script, records every change on PORTB, PTH, PTT
+	and PORTK with the tick of the step that made it, and compares the
+	record with the golden trace checked in next to the script.
+
+		trace [-u] scenario.scn...
+
+	-u writes the golden traces from this build instead of checking them.
+
+	A scenario is one directive or timed action per line, # starts a comment:
+
+		mode 1				phase selection mode, as CMD_MODE_SET
+		tolerance 2			ticks any event may move, 0 if not given
+		record 28200		only record from this second on
+		end 600				seconds to run
+		12.5 turn NS on		turn detectors N, S, E, W on or off
+		30 ambulance E on	ambulance detectors the same way
+
+	Actions must be in time order. A golden trace has one event per line,
+	tick, port and value in hex, and may give an event its own tolerance
+	in ticks as a fourth field. Events must match in order, port and
+	value, each within its tolerance.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ctl.h"
+
+#define TICKS_PER_SEC	100
+
+#define MAX_ACTIONS		256
+#define MAX_EVENTS		65536
+#define MAX_LINE		256
+
+#define NUM_PORTS		4
+
+
+//action type
+//Sensor bits to set and clear at a tick
+typedef struct{
+	INT32U tick;
+	INT8U set;
+	INT8U clear;
+} action;
+
+//event type
+//One port change
+typedef struct{
+	INT32U tick;
+	INT8U port;
+	INT8U value;
+	INT32U tolerance;
+} event;
+
+//scenario type
+typedef struct{
+	INT8U mode;
+	INT32U tolerance;
+	INT32U recordFrom;
+	INT32U end;
+	action actions[MAX_ACTIONS];
+	int numActions;
+} scenario;
+
+const char* portNames[NUM_PORTS] = {"PORTB", "PTH", "PTT", "PORTK"};
+
+event recorded[MAX_EVENTS];
+event golden[MAX_EVENTS];
+
+
+//secondsToTicks
+INT32U secondsToTicks(const char* s)
+{
+	return (INT32U)(strtod(s, NULL) * TICKS_PER_SEC + 0.5);
+}
+
+
+//directionBits
+//N, S, E and W as sensor bits, shifted to the ambulance pins for base 16
+INT8U directionBits(const char* dirs, INT8U base)
+{
+	INT8U bits;
+
+	bits = 0;
+	for(; *dirs; dirs++)
+	{
+		switch(*dirs)
+		{
+			case 'N':	bits |= base;		break;
+			case 'S':	bits |= base << 1;	break;
+			case 'E':	bits |= base << 2;	break;
+			case 'W':	bits |= base << 3;	break;
+		}
+	}
+
+	return bits;
+}
+
+
+//loadScenario
+//Returns 0 and says why if the script is bad
+int loadScenario(const char* path, scenario* sc)
+{
+	FILE* f;
+	char line[MAX_LINE],
+		word[4][64];
+	int n,
+		lineNo;
+	action* a;
+	INT8U bits;
+
+	f = fopen(path, "r");
+	if(f == NULL)
+	{
+		perror(path);
+		return 0;
+	}
+
+	memset(sc, 0, sizeof(*sc));
+	lineNo = 0;
+	while(fgets(line, sizeof(line), f))
+	{
+		lineNo++;
+		if(strchr(line, '#'))
+			*strchr(line, '#') = 0;
+
+		n = sscanf(line, "%63s %63s %63s %63s", word[0], word[1], word[2], word[3]);
+		if(n <= 0)
+			continue;
+
+		if(n == 2 && !strcmp(word[0], "mode"))
+			sc->mode = atoi(word[1]);
+		else if(n == 2 && !strcmp(word[0], "tolerance"))
+			sc->tolerance = atoi(word[1]);
+		else if(n == 2 && !strcmp(word[0], "record"))
+			sc->recordFrom = secondsToTicks(word[1]);
+		else if(n == 2 && !strcmp(word[0], "end"))
+			sc->end = secondsToTicks(word[1]);
+		else if(n == 4 && sc->numActions < MAX_ACTIONS
+			&& (!strcmp(word[1], "turn") || !strcmp(word[1], "ambulance"))
+			&& (!strcmp(word[3], "on") || !strcmp(word[3], "off")))
+		{
+			a = &sc->actions[sc->numActions++];
+			a->tick = secondsToTicks(word[0]);
+			bits = directionBits(word[2], !strcmp(word[1], "turn") ? 1 : 16);
+			a->set = !strcmp(word[3], "on") ? bits : 0;
+			a->clear = !strcmp(word[3], "off") ? bits : 0;
+
+			if(sc->numActions > 1 && a->tick < a[-1].tick)
+			{
+				fprintf(stderr, "%s:%d: actions out of time order\n", path, lineNo);
+				fclose(f);
+				return 0;
+			}
+		}
+		else
+		{
+			fprintf(stderr, "%s:%d: cannot read this line\n", path, lineNo);
+			fclose(f);
+			return 0;
+		}
+	}
+
+	fclose(f);
+	if(sc->end == 0)
+	{
+		fprintf(stderr, "%s: no end\n", path);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+//runScenario
+//Returns the events recorded
+int runScenario(ctl* c, scenario* sc)
+{
+	INT32U now;
+	INT8U porta,
+			last[NUM_PORTS],
+			ports[NUM_PORTS],
+			i;
+	int next,
+		count;
+	hostPorts* p;
+
+	ctlReset(c);
+	ctlMode(sc->mode);
+	p = ctlPorts(c);
+
+	porta = 0;
+	next = 0;
+	count = 0;
+	last[0] = p->portb;
+	last[1] = p->pth;
+	last[2] = p->ptt;
+	last[3] = p->portk;
+
+	for(now = 1; now <= sc->end; now++)
+	{
+		while(next < sc->numActions && sc->actions[next].tick <= now)
+		{
+			porta = (porta | sc->actions[next].set) & ~sc->actions[next].clear;
+			next++;
+		}
+
+		ctlStep(now, porta);
+
+		ports[0] = p->portb;
+		ports[1] = p->pth;
+		ports[2] = p->ptt;
+		ports[3] = p->portk;
+		for(i = 0; i < NUM_PORTS; i++)
+		{
+			if(ports[i] == last[i])
+				continue;
+			last[i] = ports[i];
+
+			if(now < sc->recordFrom || count == MAX_EVENTS)
+				continue;
+			recorded[count].tick = now;
+			recorded[count].port = i;
+			recorded[count].value = ports[i];
+			count++;
+		}
+	}
+
+	return count;
+}
+
+
+//goldenPath
+//The script's name with .trace in place of .scn
+void goldenPath(const char* scn, char* path, int size)
+{
+	const char* dot;
+
+	dot = strrchr(scn, '.');
+	if(dot == NULL)
+		dot = scn + strlen(scn);
+	snprintf(path, size, "%.*s.trace", (int)(dot - scn), scn);
+}
+
+
+//writeGolden
+int writeGolden(const char* path, const char* scn, int count)
+{
+	FILE* f;
+	int i;
+
+	f = fopen(path, "w");
+	if(f == NULL)
+	{
+		perror(path);
+		return 0;
+	}
+
+	fprintf(f, "# Golden trace of %s, %d events: tick, port, value [, tolerance]\n", scn, count);
+	for(i = 0; i < count; i++)
+		fprintf(f, "%u %s %02X\n", recorded[i].tick, portNames[recorded[i].port], recorded[i].value);
+
+	fclose(f);
+	return 1;
+}
+
+
+//loadGolden
+//Returns the events read, -1 if the file cannot be read
+int loadGolden(const char* path, INT32U tolerance)
+{
+	FILE* f;
+	char line[MAX_LINE],
+		port[16];
+	unsigned tick,
+			value,
+			tol;
+	int n,
+		count,
+		i;
+
+	f = fopen(path, "r");
+	if(f == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+
+	count = 0;
+	while(fgets(line, sizeof(line), f) && count < MAX_EVENTS)
+	{
+		if(line[0] == '#')
+			continue;
+
+		n = sscanf(line, "%u %15s %x %u", &tick, port, &value, &tol);
+		if(n < 3)
+			continue;
+
+		for(i = 0; i < NUM_PORTS; i++)
+			if(!strcmp(port, portNames[i]))
+				break;
+		if(i == NUM_PORTS)
+			continue;
+
+		golden[count].tick = tick;
+		golden[count].port = i;
+		golden[count].value = value;
+		golden[count].tolerance = n == 4 ? tol : tolerance;
+		count++;
+	}
+
+	fclose(f);
+	return count;
+}
+
+
+//compare
+//Returns 1 if the recording matches the golden trace
+int compare(const char* scn, int count, int goldenCount)
+{
+	int i;
+	INT32U diff;
+
+	for(i = 0; i < count && i < goldenCount; i++)
+	{
+		diff = recorded[i].tick > golden[i].tick ? recorded[i].tick - golden[i].tick : golden[i].tick - recorded[i].tick;
+
+		if(recorded[i].port != golden[i].port || recorded[i].value != golden[i].value || diff > golden[i].tolerance)
+		{
+			fprintf(stderr, "%s: event %d differs\n  golden  %u %s %02X (tolerance %u)\n  now     %u %s %02X\n",
+				scn, i + 1,
+				golden[i].tick, portNames[golden[i].port], golden[i].value, golden[i].tolerance,
+				recorded[i].tick, portNames[recorded[i].port], recorded[i].value);
+			return 0;
+		}
+	}
+
+	if(count != goldenCount)
+	{
+		fprintf(stderr, "%s: %d events, the golden trace has %d\n", scn, count, goldenCount);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+int main(int argc, char** argv)
+{
+	scenario sc;
+	ctl* c;
+	char path[512];
+	int update,
+		failed,
+		count,
+		goldenCount,
+		i;
+	clock_t begin;
+
+	update = argc > 1 && !strcmp(argv[1], "-u");
+	c = ctlCreate();
+	failed = 0;
+	begin = clock();
+
+	for(i = 1 + update; i < argc; i++)
+	{
+		if(!loadScenario(argv[i], &sc))
+			return 2;
+
+		count = runScenario(c, &sc);
+		goldenPath(argv[i], path, sizeof(path));
+
+		if(update)
+		{
+			if(!writeGolden(path, argv[i], count))
+				return 2;
+			printf("%s: %d events written\n", path, count);
+			continue;
+		}
+
+		goldenCount = loadGolden(path, sc.tolerance);
+		if(goldenCount < 0)
+			return 2;
+
+		if(compare(argv[i], count, goldenCount))
+			printf("%s: %d events match\n", argv[i], count);
+		else
+			failed++;
+	}
+
+	printf("%d scenarios in %.3f s, %d failed\n", argc - 1 - update,
+		(double)(clock() - begin) / CLOCKS_PER_SEC, failed);
+
+	ctlFree(c);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,429 @@
+/*
+	week
+
+	A week of synthetic demand at one intersection, run once under the
+	time of day schedule and once under each of its plans held all week,
+	to show what the schedule buys.
+
+	Demand follows the hour and the day: quiet nights, morning and
+	evening peaks on weekdays, a flatter day at the weekend. Each
+	approach has a through lane and a turn lane with a detector, and cars
+	leave on green the way they do in grid: a start up delay, then one per
+	headway. The same cars arrive in every run. The plans, the schedule
+	and the clock go in through the serial protocol as a central station
+	would send them, and the week starts on Monday at midnight.
+
+		week [days]
+
+	Reports each run's average delay per car, overall and by time of day.
+	Fails if the schedule does not beat the power on plan.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ctl.h"
+
+#define TICKS_PER_SEC		100
+#define TICKS_PER_HOUR		(3600 * TICKS_PER_SEC)
+
+//Light bits, as main.c has them
+#define LIGHT_NORTH		8
+#define TURN_NORTH		128
+
+#define NUM_APPROACHES	4
+#define TURN_FLAG(app)	(1 << (app))
+
+//Lanes of an approach
+#define LANE_THROUGH	0
+#define LANE_TURN		1
+
+//Cars a lane can hold, a power of 2
+#define LANE_SIZE		8192
+
+//Time from green to the first car moving, and between cars after that, as in grid
+#define LOST_TICKS		(2 * TICKS_PER_SEC)
+#define THROUGH_HEADWAY	(2 * TICKS_PER_SEC)
+#define TURN_HEADWAY		(5 * TICKS_PER_SEC / 2)
+
+//Turning cars per 100 through cars
+#define TURN_PCT		15
+
+//The serial protocol, as the README gives it
+#define PROTO_SYNC			0x7E
+#define PROTO_REPLY			0x80
+#define CMD_PLAN_UPLOAD		0x01
+#define CMD_PLAN_STORE		0x03
+#define CMD_SCHEDULE_SET	0x04
+#define CMD_CLOCK_SET		0x05
+#define PROTO_ACK			0
+
+#define NUM_PLANS		4
+#define MONDAY			1
+
+//Times of day the delays are split into
+#define PART_NIGHT		0	//22:00 to 06:00
+#define PART_PEAK		1	//07:00 to 09:00 and 16:00 to 18:00 on weekdays
+#define PART_OTHER		2
+#define NUM_PARTS		3
+
+
+//lane type
+//Arrival ticks of the cars queued, in order
+typedef struct{
+	INT32U arrive[LANE_SIZE];
+	INT32U head;
+	INT32U tail;
+	INT32U nextOut;		//Earliest tick the head may leave
+} lane;
+
+//result type
+typedef struct{
+	unsigned long long cars[NUM_PARTS];
+	double delay[NUM_PARTS];	//Seconds, summed
+	unsigned long long turnedAway;
+	INT32U maxQueue;
+} result;
+
+//Plans in the library: all red, yellow, go, turn, go after a turn (ms)
+//Plan 0 is the power on plan, the one the controller runs without a schedule
+const INT16U plans[NUM_PLANS][5] = {
+	{3000, 2000, 12000, 6000, 7000},	//Power on
+	{3000, 2000, 6000, 3000, 6000},		//Night
+	{3000, 2000, 20000, 6000, 16000},	//Off peak
+	{3000, 2000, 36000, 8000, 30000}	//Peak
+};
+
+const char* planNames[NUM_PLANS] = {"power on", "night", "off peak", "peak"};
+
+//Schedule entries: day mask (bit 0 = Sunday), plan, start hour
+//An entry runs until the next one starts, across midnight too
+#define WEEKDAYS	0x3E
+#define WEEKEND		0x41
+const INT8U schedule[][3] = {
+	{WEEKDAYS, 2, 6},
+	{WEEKDAYS, 3, 7},
+	{WEEKDAYS, 2, 9},
+	{WEEKDAYS, 3, 16},
+	{WEEKDAYS, 2, 18},
+	{WEEKDAYS, 1, 22},
+	{WEEKEND, 2, 9},
+	{WEEKEND, 1, 22}
+};
+#define SCHEDULE_ENTRIES	(sizeof(schedule) / sizeof(schedule[0]))
+
+//Through cars per hour on each approach, by hour of the day
+const INT16U weekdayDemand[24] = {
+	40, 40, 40, 40, 40, 100, 250, 480, 480, 200, 200, 200,
+	200, 200, 200, 300, 480, 480, 220, 220, 120, 120, 60, 60
+};
+const INT16U weekendDemand[24] = {
+	40, 40, 40, 40, 40, 40, 40, 40, 120, 120, 220, 220,
+	220, 220, 220, 220, 220, 220, 150, 150, 150, 150, 60, 60
+};
+
+ctl* cab;
+lane lanes[NUM_APPROACHES][2];
+INT32U rng;
+
+
+INT32U nextRandom(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+
+//command
+//Sends one frame through sciRxIsr and the serial task, returns 1 if it was acknowledged
+int command(INT8U cmd, INT8U* payload, INT8U len)
+{
+	hostPorts* p;
+	INT32U from;
+	INT8U sum;
+	int i;
+
+	p = ctlPorts(cab);
+	from = p->sciTxHead;
+
+	ctlRxByte(PROTO_SYNC);
+	ctlRxByte(len);
+	ctlRxByte(cmd);
+	sum = len + cmd;
+	for(i = 0; i < len; i++)
+	{
+		ctlRxByte(payload[i]);
+		sum += payload[i];
+	}
+	ctlRxByte((INT8U)(0 - sum));
+	ctlSerial();
+
+	//The reply is the first frame out, SYNC LEN CMD STATUS CHK
+	return p->sciTxHead - from >= 5
+		&& p->sciTx[(from + 2) & (HOST_SCI_TX_SIZE - 1)] == (cmd | PROTO_REPLY)
+		&& p->sciTx[(from + 3) & (HOST_SCI_TX_SIZE - 1)] == PROTO_ACK;
+}
+
+
+//planBytes
+//A plan in its wire format, after an optional plan ID
+INT8U planBytes(INT8U* p, int plan)
+{
+	int i;
+
+	for(i = 0; i < 5; i++)
+	{
+		p[2 * i] = plans[plan][i] >> 8;
+		p[2 * i + 1] = plans[plan][i];
+	}
+	return 10;
+}
+
+
+//loadSchedule
+//What a central station sends to start the schedule
+int loadSchedule(void)
+{
+	INT8U payload[48];
+	INT16U minute;
+	int i,
+		ok;
+
+	ok = 1;
+	for(i = 0; i < NUM_PLANS; i++)
+	{
+		payload[0] = i;
+		ok &= command(CMD_PLAN_STORE, payload, 1 + planBytes(payload + 1, i));
+	}
+
+	for(i = 0; i < (int)SCHEDULE_ENTRIES; i++)
+	{
+		minute = schedule[i][2] * 60;
+		payload[4 * i] = schedule[i][0];
+		payload[4 * i + 1] = schedule[i][1];
+		payload[4 * i + 2] = minute >> 8;
+		payload[4 * i + 3] = minute;
+	}
+	ok &= command(CMD_SCHEDULE_SET, payload, 4 * SCHEDULE_ENTRIES);
+
+	payload[0] = MONDAY;
+	payload[1] = 0;
+	payload[2] = 0;
+	ok &= command(CMD_CLOCK_SET, payload, 3);
+
+	return ok;
+}
+
+
+//dayPart
+int dayPart(INT32U tick)
+{
+	INT32U hour,
+			day;
+
+	hour = tick / TICKS_PER_HOUR % 24;
+	day = (MONDAY + tick / (24 * TICKS_PER_HOUR)) % 7;
+
+	if(hour >= 22 || hour < 6)
+		return PART_NIGHT;
+	if(day != 0 && day != 6 && (hour == 7 || hour == 8 || hour == 16 || hour == 17))
+		return PART_PEAK;
+	return PART_OTHER;
+}
+
+
+//leave
+void leave(result* r, INT32U arrive, INT32U now)
+{
+	int part;
+
+	part = dayPart(arrive);
+	r->cars[part]++;
+	r->delay[part] += (double)(now - arrive) / TICKS_PER_SEC;
+}
+
+
+//runWeek
+//plan is the one held all week, or -1 for the schedule
+int runWeek(int plan, INT32U days, result* r)
+{
+	INT8U payload[16],
+			greens,
+			lastGreens,
+			inputs,
+			app,
+			k,
+			bit;
+	INT32U now,
+			end,
+			hour,
+			day,
+			perHour,
+			queued;
+	lane* l;
+
+	ctlReset(cab);
+	memset(lanes, 0, sizeof(lanes));
+	memset(r, 0, sizeof(*r));
+	rng = 2463534242u;
+
+	if(plan < 0 && !loadSchedule())
+		return 0;
+	if(plan > 0 && !command(CMD_PLAN_UPLOAD, payload, planBytes(payload, plan)))
+		return 0;
+
+	lastGreens = 0;
+	end = days * 24 * TICKS_PER_HOUR;
+	for(now = 1; now <= end; now++)
+	{
+		//Arrivals, the same in every run
+		hour = now / TICKS_PER_HOUR % 24;
+		day = (MONDAY + now / (24 * TICKS_PER_HOUR)) % 7;
+		perHour = day == 0 || day == 6 ? weekendDemand[hour] : weekdayDemand[hour];
+		for(app = 0; app < NUM_APPROACHES; app++)
+			for(k = 0; k < 2; k++)
+			{
+				if(nextRandom() % TICKS_PER_HOUR >= (k == LANE_TURN ? perHour * TURN_PCT / 100 : perHour))
+					continue;
+				l = &lanes[app][k];
+				if(l->tail - l->head == LANE_SIZE)
+				{
+					r->turnedAway++;
+					continue;
+				}
+				l->arrive[l->tail++ & (LANE_SIZE - 1)] = now;
+			}
+
+		//A car at the head of a turn lane holds the detector
+		inputs = 0;
+		for(app = 0; app < NUM_APPROACHES; app++)
+			if(lanes[app][LANE_TURN].head != lanes[app][LANE_TURN].tail)
+				inputs |= TURN_FLAG(app);
+
+		ctlStep(now, inputs);
+		ctlSerial();
+		if(ctlConflict())
+		{
+			fprintf(stderr, "week: conflict fault %u at tick %u\n", ctlConflict(), now);
+			return 0;
+		}
+
+		//Departures, after the start up delay of a new green
+		greens = ctlGreens();
+		for(app = 0; app < NUM_APPROACHES; app++)
+			for(k = 0; k < 2; k++)
+			{
+				bit = k == LANE_TURN ? TURN_NORTH >> app : LIGHT_NORTH >> app;
+				l = &lanes[app][k];
+				if(greens & bit & ~lastGreens)
+					l->nextOut = now + LOST_TICKS;
+
+				queued = l->tail - l->head;
+				if(queued > r->maxQueue)
+					r->maxQueue = queued;
+
+				if(!(greens & bit) || !queued || (INT32S)(l->nextOut - now) > 0)
+					continue;
+
+				leave(r, l->arrive[l->head++ & (LANE_SIZE - 1)], now);
+				l->nextOut = now + (k == LANE_TURN ? TURN_HEADWAY : THROUGH_HEADWAY);
+			}
+		lastGreens = greens;
+	}
+
+	//Cars still waiting count with the delay they have had so far
+	for(app = 0; app < NUM_APPROACHES; app++)
+		for(k = 0; k < 2; k++)
+		{
+			l = &lanes[app][k];
+			while(l->head != l->tail)
+				leave(r, l->arrive[l->head++ & (LANE_SIZE - 1)], end);
+		}
+
+	return 1;
+}
+
+
+//average
+double average(result* r, int part)
+{
+	unsigned long long cars;
+	double delay;
+	int i;
+
+	if(part >= 0)
+		return r->cars[part] ? r->delay[part] / r->cars[part] : 0.0;
+
+	cars = 0;
+	delay = 0;
+	for(i = 0; i < NUM_PARTS; i++)
+	{
+		cars += r->cars[i];
+		delay += r->delay[i];
+	}
+	return cars ? delay / cars : 0.0;
+}
+
+
+//report
+void report(const char* name, result* r)
+{
+	printf("%-22s %8llu %9.1f %9.1f %9.1f %9.1f %9u\n", name,
+		r->cars[0] + r->cars[1] + r->cars[2],
+		average(r, -1), average(r, PART_NIGHT), average(r, PART_PEAK), average(r, PART_OTHER),
+		r->maxQueue);
+}
+
+
+int main(int argc, char** argv)
+{
+	result single[NUM_PLANS],
+			scheduled;
+	char name[32];
+	INT32U days;
+	int plan,
+		best;
+	clock_t begin;
+
+	days = argc > 1 ? atoi(argv[1]) : 7;
+	cab = ctlCreate();
+	begin = clock();
+
+	printf("%u days from Monday, delay per car in s\n", days);
+	printf("%-22s %8s %9s %9s %9s %9s %9s\n", "", "cars", "all", "night", "peaks", "other", "max queue");
+
+	best = 0;
+	for(plan = 0; plan < NUM_PLANS; plan++)
+	{
+		if(!runWeek(plan, days, &single[plan]))
+		{
+			fprintf(stderr, "week: plan %d run failed\n", plan);
+			return 1;
+		}
+		snprintf(name, sizeof(name), "%s plan only", planNames[plan]);
+		report(name, &single[plan]);
+		if(average(&single[plan], -1) < average(&single[best], -1))
+			best = plan;
+	}
+
+	if(!runWeek(-1, days, &scheduled))
+	{
+		fprintf(stderr, "week: schedule run failed\n");
+		return 1;
+	}
+	report("schedule", &scheduled);
+
+	printf("schedule vs power on plan %+.1f%%, vs best single plan (%s) %+.1f%%, %.1f s\n",
+		100.0 * (average(&scheduled, -1) / average(&single[0], -1) - 1),
+		planNames[best],
+		100.0 * (average(&scheduled, -1) / average(&single[best], -1) - 1),
+		(double)(clock() - begin) / CLOCKS_PER_SEC);
+
+	if(single[0].turnedAway || scheduled.turnedAway)
+		printf("cars turned away with a lane full: %llu power on, %llu schedule\n",
+			single[0].turnedAway, scheduled.turnedAway);
+
+	return average(&scheduled, -1) < average(&single[0], -1) ? 0 : 1;
+}
@@ -25,8 +25,71 @@
 			DEFINITIONS
 ******************************************************/
 
-//Standard task stack size
-#define TASK_STK_SIZE   1024
+//Task stack sizes
+//Kept at the 1024 bytes the tasks have always had until they are measured
+/*
+	Every stack is painted and the STACK report gives each task's high
+	water mark since boot; host/stacks measures the same on a host build.
+	Once a soak run on the board has reported the marks, each size becomes
+	its task's mark plus STK_MARGIN. Until then the STACK report flags any
+	task that reaches into the last STK_MARGIN bytes of its stack.
+*/
+#define STK_MARGIN			64
+
+#define CONTROLLER_STK_SIZE	1024
+#define SUPERVISOR_STK_SIZE	1024
+#define SERIAL_STK_SIZE		1024
+
+//Storage class of the search scratch and the board wide state the steps touch
+//Plain on the board, a host build running intersections on several threads
+//defines it thread local
+#ifndef PER_THREAD
+#define PER_THREAD
+#endif
+
+//Number of tasks profiled for stack usage
+#define NUM_TASKS		3
+
+//Task priorities
+//The controller keeps the same priority for its whole life
+//The serial task busy waits on the transmitter, so it runs below the controller
+#define CONTROLLER_TASK_PRIO	10
+#define SERIAL_TASK_PRIO		15
+#define SUPERVISOR_TASK_PRIO	20
+
+//Protothreads
+/*
+	The light cycle and the ambulance handler are protothreads run by the
+	controller task. A protothread is a function that returns whenever it
+	has to wait and, on its next call, jumps back to where it left off
+	through the switch in PT_BEGIN. No stack is kept between calls, so
+	anything a thread needs after a wait must be kept in the intersection, and
+	there can be no switch statements and only one wait per line inside one.
+*/
+#define PT_WAITING	0
+#define PT_DONE		1
+
+#define PT_BEGIN(pt)		switch((pt)->lc) { case 0:
+#define PT_END(pt)		} (pt)->lc = 0; return PT_DONE
+
+//Return until cond is true, then carry on from here
+//Every wait that ends counts as progress for the supervisor
+#define PT_WAIT_UNTIL(pt, cond)	(pt)->lc = __LINE__; case __LINE__: if(!(cond)) return PT_WAITING; \
+					(pt)->progress = ix->schedNow
+
+//Wait for a number of ms
+#define PT_DELAY(pt, ms)	(pt)->wake = ix->schedNow + msToTicks(ms); \
+					PT_WAIT_UNTIL(pt, (INT32S)(ix->schedNow - (pt)->wake) >= 0)
+
+//Change the lights, waiting out the yellows
+//wake holds the start of the change, each yellow ends after its own clearance
+#define PT_CHANGE_LIGHTS(pt, state)	startLightChange(state); \
+					(pt)->wake = ix->schedNow; \
+					PT_WAIT_UNTIL(pt, finishLightChange(ix->schedNow - (pt)->wake))
+
+//Ambulance time (ms)
+//How long an ambulance gets its green
+#define AMBULANCE_GREEN_MS	12000
 
 //Light bits
 //These are the bits designating the individual light status
@@ -121,6 +184,287 @@
 #define LED_WALK_NS_RED
 #define LED_WALK_EW_RED
 
+//Movements of each axis
+#define NS_MOVEMENTS	(LIGHT_NORTH | LIGHT_SOUTH | TURN_NORTH | TURN_SOUTH)
+#define EW_MOVEMENTS	(LIGHT_EAST | LIGHT_WEST | TURN_EAST | TURN_WEST)
+
+//Supervision
+//Timing for the supervisor task and the COP watchdog
+
+//How often the supervisor runs (ms)
+#define SUPERVISOR_PERIOD_MS	250
+
+//Longest each thread may go without finishing a wait, its longest wait plus 2 seconds
+//A thread stuck in a wait, or the controller task not running at all, shows up here
+//A controller task that spins without blocking starves the supervisor instead,
+//so the COP goes unserviced and resets the board
+#define CYCLE_STALL_TICKS		((PLAN_MAX_GREEN_MS / 1000 + 2) * (INT32U)OS_TICKS_PER_SEC)
+#define AMBULANCE_STALL_TICKS	((AMBULANCE_GREEN_MS / 1000 + 2) * (INT32U)OS_TICKS_PER_SEC)
+
+//Threads passed to restartController
+#define STALL_CYCLE		1
+#define STALL_AMBULANCE	2
+
+//In place restarts allowed without progress before the COP is left to reset the board
+#define MAX_STALL_RESTARTS	2
+
+//How often the metrics are printed (seconds)
+#define METRICS_REPORT_SECS	60
+
+//COP rate select: 2^24 OSCCLK cycles, about 2 seconds with an 8MHz crystal
+#define COP_RATE		0x07
+
+//Free running timer, used to time predictive decisions
+//Bus clock / 16 is 4 us a count with the 4MHz bus of an 8MHz crystal,
+//so TCNT wraps after 262 ms
+#define TSCR1_TEN			0x80
+#define TIMER_PRESCALE		0x04
+#define TIMER_US_PER_COUNT	4
+
+//Checkpoint
+//Marks a checkpoint that survived a reset
+#define CHECKPOINT_MAGIC	0x5A3C
+
+//Timing plan limits (ms)
+//An uploaded plan outside these is rejected
+//Nothing may be longer than OSTimeDlyHMSM can take in seconds and ms
+#define PLAN_MIN_ALL_RED_MS	1000
+#define PLAN_MAX_ALL_RED_MS	6000
+#define PLAN_MIN_YELLOW_MS	2000
+#define PLAN_MAX_YELLOW_MS	6000
+#define PLAN_MIN_GREEN_MS	2000
+#define PLAN_MAX_GREEN_MS	59000
+
+//SCI0 bits
+#define SCI_RDRF		0x20	//SCI0SR1 receive data register full
+#define SCI_TDRE		0x80	//SCI0SR1 transmit data register empty
+#define SCI_RIE		0x20	//SCI0CR2 receive interrupt enable
+
+//Serial protocol
+/*
+	Frames in both directions:
+	
+		SYNC  LEN  CMD  PAYLOAD[LEN]  CHK
+	
+	SYNC is 0x7E, LEN counts payload bytes only, and CHK makes the
+	8 bit sum of LEN, CMD, PAYLOAD and CHK come out to 0.
+	Multi byte values are big endian.
+	Every command is answered with CMD | PROTO_REPLY.
+*/
+#define PROTO_SYNC		0x7E
+#define PROTO_MAX_PAYLOAD	48
+#define PROTO_REPLY		0x80
+
+//Commands
+#define CMD_PLAN_UPLOAD	0x01	//Payload: timing plan, reply: status
+#define CMD_PLAN_QUERY	0x02	//No payload, reply: active plan
+#define CMD_PLAN_STORE	0x03	//Payload: plan ID then timing plan, reply: status
+#define CMD_SCHEDULE_SET	0x04	//Payload: schedule entries, reply: status
+#define CMD_CLOCK_SET		0x05	//Payload: day of week, minute of day, reply: status
+#define CMD_BINS_GET		0x06	//Payload: bin kind, bins to skip, bin count, reply: bins
+#define CMD_MODE_SET		0x07	//Payload: phase selection mode, reply: status
+#define CMD_GEOMETRY_SET	0x08	//Payload: approach geometry per movement, reply: status
+#define CMD_DEMAND_SET	0x09	//Payload: through veh/h per approach, reply: status
+
+//Reply status
+#define PROTO_ACK		0
+#define PROTO_NAK_LENGTH	1	//Payload length wrong for the command
+#define PROTO_NAK_RANGE	2	//A value is outside its limits
+#define PROTO_NAK_UNKNOWN	3	//Unknown command
+
+//Receive buffer filled by the SCI0 interrupt, must be a power of 2
+#define SERIAL_RX_SIZE	64
+
+//Console lines queued for the serial task, must be a power of 2
+#define CONSOLE_QUEUE_SIZE	16
+
+//Plan scheduler
+//Plans the schedule can choose from, plan 0 is the power on plan
+#define NUM_PLANS		4
+
+//Schedule entries that fit in one CMD_SCHEDULE_SET frame
+#define MAX_SCHEDULE_ENTRIES	12
+#define SCHEDULE_ENTRY_SIZE	4
+
+//The week is indexed in slots, schedule entries must start on a slot boundary
+//15 minute slots keep the index at 672 bytes, per minute would not fit in RAM
+#define SLOT_MINUTES		15
+#define SLOTS_PER_DAY		(24 * 60 / SLOT_MINUTES)
+#define SLOTS_PER_WEEK	(7 * SLOTS_PER_DAY)
+#define MINUTES_PER_WEEK	(7 * 24 * 60)
+
+//Cycles taken to blend from one plan to the next
+#define PLAN_TRANSITION_CYCLES	3
+
+//Detectors
+//The turn lane sensors are the vehicle detectors, PORTA pins 1-4
+#define NUM_DETECTORS		4
+#define DETECTOR_MASK		(NORTH_TURN_FLAG + SOUTH_TURN_FLAG + EAST_TURN_FLAG + WEST_TURN_FLAG)
+
+//Detectors are sampled once per controller step, every OS tick
+#define SAMPLES_PER_MINUTE	(60 * OS_TICKS_PER_SEC)
+
+//Occupancy is fixed point in half percent steps, 200 = 100%
+#define OCC_FULL			200
+
+//Rolling bins
+//15 one minute bins feed each 15 minute bin, 96 of those cover a day
+#define MINUTE_BINS		15
+#define QUARTER_BINS		96
+
+//Bin kinds for CMD_BINS_GET
+#define BIN_MINUTE		0
+#define BIN_QUARTER		1
+
+//Telemetry
+/*
+	Sent unprompted with the same framing as the serial protocol.
+	The image is cState.lstate, cState.astate, PORTA, PORTB, PTH, PTT,
+	PORTK and cflags, in that order. Every frame starts with a sequence
+	number so a lost frame shows up as a gap; wait for the next keyframe.
+	
+		TELEM_KEYFRAME	seq, the whole image
+		TELEM_DELTA		seq, mask of changed fields, XOR of each changed field
+		TELEM_BIT		seq, field << 3 | bit, for a single bit flip
+*/
+#define TELEM_KEYFRAME	0x40
+#define TELEM_DELTA		0x41
+#define TELEM_BIT		0x42
+
+#define TELEM_FIELDS		8
+
+//A keyframe goes out this often so a receiver can join or recover
+#define TELEM_KEYFRAME_SECS	10
+
+//SYNC LEN CMD and CHK around every frame
+#define PROTO_OVERHEAD	4
+
+//Phase selection modes for CMD_MODE_SET
+#define MODE_FIXED		0	//determineNextState and the plan times
+#define MODE_PREDICTIVE	1	//predictNextState
+#define MODE_ADAPTIVE		2	//determineNextState and the plan greens scaled by the adaptive split
+
+//Adaptive split
+/*
+	In adaptive mode each axis' turn greens are the plan's scaled by
+	splitPct[axis] and its go greens by goPct[axis].
+	The turn split is measured. An axis' degree of saturation is the
+	occupancy of its turn detectors
+	while their own turn is green: a queue that keeps a detector covered
+	for its whole turn green needed all of it. Outside its turn phase a
+	detector only shows turners waiting, so it is not counted then.
+	After every cycle (both axes served) the total of the two scales moves
+	a step up if either axis is saturated or down if neither is busy, and
+	each axis' scale moves a step towards its share of the total by
+	saturation. An axis that had no turn phase counts as not busy.
+	There are no through detectors, so the go split comes from the through
+	demand set with CMD_DEMAND_SET: each axis' go scale moves a step per
+	cycle towards its busier approach's demand over PLAN_THROUGH_VPH, the
+	demand the plan go greens are meant for. A major road gets longer go
+	greens and its minor road shorter ones, and the cycle follows.
+*/
+#define SPLIT_STEP_PCT	10	//Most a scale or the total moves per cycle
+#define SPLIT_MIN_PCT		50
+#define SPLIT_MAX_PCT		200
+
+//Limits on the total, the turn greens run from 3/4 to 3/2 of the plan's
+//Below twice SPLIT_MAX_PCT so a long cycle still leaves room to split
+#define SPLIT_MIN_TOTAL_PCT	150
+#define SPLIT_MAX_TOTAL_PCT	300
+
+//Saturation (OCC_FULL = 100%) above which the cycle grows, and below which on both axes it shrinks
+#define SPLIT_SAT_HIGH	180
+#define SPLIT_SAT_LOW		100
+
+//Through demand (veh/h per approach)
+//There are no through detectors, so it is configured with CMD_DEMAND_SET
+//The plan go greens are taken to be sized for PLAN_THROUGH_VPH, which is also
+//the demand until one is set; a lane cannot carry more than MAX_THROUGH_VPH
+#define PLAN_THROUGH_VPH	290
+#define MAX_THROUGH_VPH	1800
+
+//Predictive phase selection
+/*
+	Each time the cycle is about to give an axis green, predictNextState
+	searches sequences of MPC_HORIZON half cycles (one axis green each),
+	choosing per half cycle which turns get a turn phase and how long the
+	turn and go greens are. Queues are run forward with a fluid model and
+	the sequence with the least average queue over its length wins, so a
+	sequence of short half cycles does not win just by ending sooner; only
+	its first half cycle is used, the search runs again at the next decision.
+	
+	Every first half cycle is scored, each followed by greedy half cycles
+	out to the horizon. Every second half cycle is then tried under the
+	MPC_REFINE cheapest first ones. The node budget covers all of that,
+	so every search finishes; the MPC line of the metrics report shows
+	the nodes and the time a decision really takes.
+	
+	Units are deciseconds (ds) for time and milli-vehicles (mveh) for queues,
+	so rates are mveh/ds and everything stays in 32 bit integers.
+	Movements 0-3 are the N, S, E, W turns (same order as the sensor bits),
+	4-7 the N, S, E, W throughs.
+*/
+#define MPC_HORIZON		4
+
+//First half cycles every second half cycle is searched under
+#define MPC_REFINE		2
+
+//Search nodes per decision, enough for the whole search
+//Scoring every first half cycle takes MPC_ACTIONS * MPC_HORIZON of them
+//and each refined one at most 1 + MPC_ACTIONS * (MPC_HORIZON - 1) more
+#define MPC_NODE_BUDGET	(MPC_ACTIONS * MPC_HORIZON + MPC_REFINE * (1 + MPC_ACTIONS * (MPC_HORIZON - 1)))
+
+//Score of a sequence that breaks the max wait rule
+#define MPC_NO_SCORE	0x7FFFFFFF
+
+//Green times are tried at the plan time and this much either side
+#define MPC_STEP_MS		2000
+
+//A turn with a queue may not wait longer than this for a turn phase
+#define MPC_MAX_WAIT_DS	1200
+
+//Saturation flow of one lane (mveh/ds)
+#define SAT_TURN_RATE		40		//2.5 s headway
+#define SAT_THROUGH_RATE	50		//2 s headway
+
+//Start up lost time at the start of every green (ds), nothing leaves during it
+#define MPC_LOST_DS		20
+
+//Minutes of detector history used for the turn arrival rates
+#define MPC_HISTORY_MINUTES	3
+
+//Queues are capped at 100 vehicles so delays cannot overflow
+#define MPC_MAX_QUEUE		100000
+
+#define NUM_MOVEMENTS		8
+
+//Actions per half cycle: the greedy one, 3 go times without a turn phase
+//and 3 turn selections x 3 turn times x 3 go times
+#define MPC_ACTIONS		31
+
+//Clearance intervals
+/*
+	Worked out per movement (same order as the predictive movements) from
+	its approach speed v, grade G and the width W it has to clear:
+	
+		yellow = t + v / (2a + 2Gg)
+		red = (W + L) / v
+	
+	with t = 1 s reaction, a = 10 ft/s^2 braking, g = 32.2 ft/s^2 and
+	L = 20 ft vehicle length. For a turn v is the turning speed and W the
+	length of its path across. A movement with no geometry uses the plan.
+*/
+#define CLEAR_VEHICLE_FT	20
+
+//Geometry limits, 70 mph keeps the yellow sum inside 32 bits
+#define MIN_APPROACH_MPH	10
+#define MAX_APPROACH_MPH	70
+#define MAX_GRADE_PCT		10
+
+//Bin sizes on the wire
+#define MINUTE_BIN_WIRE_SIZE	(2 * NUM_DETECTORS)
+#define QUARTER_BIN_WIRE_SIZE	(3 * NUM_DETECTORS)
+
 /******************************************************
 			TYPE DEFINITIONS
 ******************************************************/
@@ -139,27 +483,331 @@ typedef struct{
 //Lightstate contains the state of the lights
 //Ambulance state actually only contains walk state
 
+//checkpoint type
+//Last settled light state, kept in RAM that is not cleared on a COP reset
+//check is the complement of the state bytes so garbage is not mistaken for a state
+typedef struct{
+	INT16U magic;		//CHECKPOINT_MAGIC once the counters are initialized
+	INT8U settled;		//1 while state matches the LEDs, 0 during changes
+	lightState state;	//Last settled state on the LEDs
+	INT8U check;		//~(lstate ^ astate)
+	INT16U coldBoots;	//Boots that went through all red
+	INT16U warmBoots;	//Boots that restored the checkpoint
+} checkpoint;
+
+//timingPlan type
+//All the times the main cycle uses, in ms
+//Sent over the serial port in this order
+typedef struct{
+	INT16U allRedMs;	//All red between states, movements with no geometry
+	INT16U yellowMs;	//Yellow on lights changing to red, movements with no geometry
+	//Greens are timed from when the last yellow before them ends
+	INT16U goMs;		//Green for a go state with no turn before it
+	INT16U turnMs;		//Green for a turn state
+	INT16U turnGoMs;	//Green for the go state following a turn
+} timingPlan;
+
+//Size of a timing plan on the wire
+#define PLAN_WIRE_SIZE	10
+
+//approachGeometry type
+//What a movement's clearance intervals are worked out from
+//Sent over the serial port in this order
+typedef struct{
+	INT8U speedMph;		//Approach speed, 0 to use the plan's times
+	INT8S gradePct;		//Approach grade, negative downhill
+	INT8U widthFt;		//Distance to clear the far side
+} approachGeometry;
+
+//Size of one movement's geometry on the wire
+#define GEOMETRY_WIRE_SIZE	3
+
+//protothread type
+//Where a protothread left off
+typedef struct{
+	INT16U lc;		//Line to resume at, 0 to start from the top
+	INT32U wake;	//Tick a PT_DELAY ends at
+	INT32U progress;	//Tick its last wait ended
+} protothread;
+
+//taskStack type
+//Stack profile of one task
+typedef struct{
+	char* name;		//Name for the report
+	INT8U prio;		//Task priority
+	INT16U size;	//Stack size
+	INT16U maxUsed;	//Highest usage seen since boot
+} taskStack;
+
+//minuteBin type
+//Vehicles counted and occupancy for one minute, per detector
+typedef struct{
+	INT8U volume[NUM_DETECTORS];		//Vehicles, counted on the rising edge
+	INT8U occupancy[NUM_DETECTORS];	//Half percent steps
+} minuteBin;
+
+//quarterBin type
+//Same for 15 minutes
+typedef struct{
+	INT16U volume[NUM_DETECTORS];
+	INT8U occupancy[NUM_DETECTORS];
+} quarterBin;
+
+//mpcState type
+//Predicted state of the intersection at a point in the search
+typedef struct{
+	INT32S queue[NUM_MOVEMENTS];	//Queue per movement (mveh)
+	INT16U wait[NUM_DETECTORS];		//Time each turn has gone without a turn phase (ds)
+	INT32S cost;				//Total delay so far (veh ds)
+	INT16U elapsed;				//Time since the decision (ds)
+} mpcState;
+
+//controllerMetrics type
+//Operational metrics reported over the serial port
+typedef struct{
+	INT32U telemBytes;		//Telemetry bytes sent, framing included
+	INT32U telemUpdates;	//Telemetry frames sent
+	INT32U mpcDecisions;	//Predictive decisions made
+	INT32U mpcNodesTotal;	//Search nodes used by all of them
+	INT16U mpcNodes;		//Search nodes used by the last predictive decision
+	INT16U mpcCounts;		//Timer counts the last predictive decision took
+	INT16U mpcMaxCounts;	//Slowest predictive decision seen since boot (timer counts)
+	INT16U mpcBudgetHits;	//Predictive decisions cut short by the node budget
+	INT8U mpcRefined;		//First half cycles the last decision searched under
+	INT16U consoleDropped;	//Console lines dropped with the queue full
+	INT16U restarts;		//In place restarts of the controller task
+	INT16U stallRestarts;	//Restarts caused by a stalled controller task
+	INT32U lastRecoveryTicks;	//Ticks from restart request to the threads running again
+	INT32U maxRecoveryTicks;	//Worst recovery seen since boot
+} controllerMetrics;
+
+//intersection type
+//Everything the controller keeps about the intersection it runs
+//Every function works on the one ix points at
+typedef struct{
+	//Current State of the lights
+	lightState cState;
+	
+	//State actually on the LEDs, ALL_STOP included
+	//cState skips ALL_STOP so determineNextState knows where the cycle was
+	lightState ledState;
+	
+	//Light change in progress
+	//yFlags are lights passing through yellow, gFlags lights waiting for opposing yellow
+	//lightsChanging is set from startLightChange to finishLightChange
+	INT8U yFlags;
+	INT8U gFlags;
+	INT8U lightsChanging;
+	
+	//Current input flags
+	lightFlags cflags;
+	
+	//Protothreads and the tick and inputs they are run with
+	//Nothing in a step reads PORTA itself, so the caller decides what the sensors show
+	protothread cyclePt;
+	protothread ambulancePt;
+	INT32U schedNow;
+	INT8U schedInputs;
+	
+	//What the light cycle carries across its waits
+	lightState cycleNext;		//Next state of the cycle
+	INT8U cyclePredicted;		//Set when predictNextState chose the greens
+	
+	//What the ambulance handler carries across its waits
+	lightState ambTarget;		//State giving the ambulance its green
+	lightState ambResume;		//cState of the light cycle when it was preempted
+	lightState ambResumeLeds;	//LEDs of the light cycle when it was preempted
+	
+	//Preemption
+	//The ambulance thread raises preemptRequest
+	//The controller grants it with preempted once no light change is in progress,
+	//then stops running the light cycle until preemptRequest drops
+	//preemptRemaining is the delay the light cycle had left when it was preempted
+	INT8U preemptRequest;
+	INT8U preempted;
+	INT32U preemptRemaining;
+	
+	//Timing plans
+	//Double buffered, the main cycle runs plans[activePlan]
+	//Uploads go into the other slot and planPending asks for a swap
+	//The swap happens at the top of the main cycle, never in the middle of one
+	timingPlan plans[2];
+	INT8U activePlan;
+	INT8U planPending;
+	
+	//Plans the scheduler switches between, loaded with CMD_PLAN_STORE
+	timingPlan planLibrary[NUM_PLANS];
+	
+	//Plan ID for every slot of the week, starting Sunday 00:00
+	//Built from the schedule table so a lookup is a single array read
+	INT8U planIndex[SLOTS_PER_WEEK];
+	
+	//Scheduler enable
+	//The scheduler runs once both the schedule and the clock have been loaded
+	INT8U scheduleLoaded;
+	INT8U clockSet;
+	
+	//Time of day clock
+	//Minute of the week at clockBaseTicks, set with CMD_CLOCK_SET
+	INT16U clockBaseMinute;
+	INT32U clockBaseTicks;
+	
+	//Plan transition
+	//schedPlan is the plan the schedule wants, transFrom is what was running when it changed
+	//transStep counts the cycles of the blend, 0 when not blending
+	//schedPlan starts invalid so the first lookup always blends into the scheduled plan
+	INT8U schedPlan;
+	timingPlan transFrom;
+	INT8U transStep;
+	
+	//Approach geometry
+	//Per movement, set with CMD_GEOMETRY_SET
+	//geometryPending asks for the clearances to be worked out again at the top of the cycle
+	approachGeometry geometry[NUM_MOVEMENTS];
+	INT8U geometryPending;
+	
+	//Clearance intervals (ms)
+	//Per movement, worked out by computeClearances whenever a plan is applied
+	INT16U yellowClearMs[NUM_MOVEMENTS];
+	INT16U redClearMs[NUM_MOVEMENTS];
+	
+	//All red needed after the last change that stopped anything,
+	//the longest red clearance of the lights it stopped
+	INT16U allRedClearMs;
+	
+	//Detector bins
+	//Circular buffers, minuteCount and quarterCount are the bins closed so far
+	//and the newest bin sits at (count - 1) % size
+	//The sizes are not powers of 2, so the counts are 32 bit and never wrap in service
+	minuteBin minuteBins[MINUTE_BINS];
+	quarterBin quarterBins[QUARTER_BINS];
+	INT32U minuteCount;
+	INT32U quarterCount;
+	
+	//Detector accumulators
+	//Counts for the minute and quarter being filled
+	INT8U detLast;					//Detector bits at the last sample
+	INT16U detSamples;				//Samples taken this minute
+	INT16U detOnSamples[NUM_DETECTORS];	//Samples with the detector occupied
+	INT8U detVolume[NUM_DETECTORS];		//Vehicles this minute
+	INT16U quarterVolume[NUM_DETECTORS];	//Vehicles this quarter
+	INT16U quarterOccSum[NUM_DETECTORS];	//Sum of the minute occupancies this quarter
+	
+	//Phase selection
+	//phaseMode picks how the cycle decides, set with CMD_MODE_SET
+	//phaseTurnMs and phaseGoMs are the greens for the half cycle in progress
+	INT8U phaseMode;
+	INT16U phaseTurnMs;
+	INT16U phaseGoMs;
+	
+	//Adaptive split
+	//splitPct scales each axis' turn greens, NS then EW
+	//splitGreenSamples and splitOccSamples are each axis' detector samples taken
+	//with their own turn green and those of them occupied, since the last update
+	//splitServed has bit 0 set once NS has had green and bit 1 once EW has
+	//goPct scales each axis' go greens the same way, following throughVph
+	INT16U splitPct[2];
+	INT16U goPct[2];
+	INT16U splitGreenSamples[2];
+	INT16U splitOccSamples[2];
+	INT8U splitServed;
+	
+	//Through demand per approach, N, S, E, W, set with CMD_DEMAND_SET (veh/h)
+	INT16U throughVph[NUM_DETECTORS];
+	
+	//Service history for the predictive model
+	//Tick each turn last had a turn phase and each axis last had its go green end
+	INT32U turnServedTick[NUM_DETECTORS];
+	INT32U axisGreenEndTick[2];
+	
+	//Telemetry
+	//telemLast is the image the receiver has, as of the last frame sent
+	INT8U telemLast[TELEM_FIELDS];
+	INT8U telemSeq;
+	INT8U telemStarted;
+	INT32U telemKeyTick;
+	
+	//Console
+	//SCI0 has one writer, the serial task, so console lines from the other tasks
+	//are queued here as pointers to constant strings and sent between frames
+	//reportDue asks the serial task for the metrics and stack report
+	const char* console[CONSOLE_QUEUE_SIZE];
+	INT8U consoleHead;
+	INT8U consoleTail;
+	INT8U reportDue;
+	
+	//Set when main() restored the checkpoint so the light cycle skips all red
+	INT8U warmStart;
+	
+	//Uptime comes from OSTimeGet, the rest is counted here
+	controllerMetrics ctrlMetrics;
+} intersection;
+
 
 /******************************************************
 			GLOBAL VARS
 			(SO SUE ME)
 ******************************************************/
 
-//cState
-//Current State of the lights
-lightState cState;
+//boardIntersection
+//The intersection this board controls
+intersection boardIntersection;
 
-//cflags
-//Current input flags
-lightFlags cflags;
+//ix
+//Intersection every function works on
+//Always boardIntersection on the board, a host build switches it between its own
+PER_THREAD intersection* ix = &boardIntersection;
 
-//Task Stacks
-OS_STK  MainLightCycleStk[TASK_STK_SIZE];
-OS_STK  ambulanceHandlerStk[TASK_STK_SIZE];
-OS_STK  testLEDsStk[TASK_STK_SIZE];
+//defaultPlan
+//Power on timing plan, every plan slot starts out with it
+const timingPlan defaultPlan = {3000, 2000, 12000, 6000, 7000};
 
-//New ambulance main task priority variable
-INT8U mainTaskPrio;
+//Task Stacks
+OS_STK  controllerStk[CONTROLLER_STK_SIZE];
+OS_STK  supervisorStk[SUPERVISOR_STK_SIZE];
+OS_STK  serialStk[SERIAL_STK_SIZE];
+
+//taskStacks
+//Stack profile of every task, updated by the supervisor
+taskStack taskStacks[NUM_TASKS] = {
+	{"CONTROLLER", CONTROLLER_TASK_PRIO, CONTROLLER_STK_SIZE, 0},
+	{"SUPERVISOR", SUPERVISOR_TASK_PRIO, SUPERVISOR_STK_SIZE, 0},
+	{"SERIAL", SERIAL_TASK_PRIO, SERIAL_STK_SIZE, 0}
+};
+
+//Search space for predictNextState, one state per depth
+//Kept off the stack, the controller task stack is small
+PER_THREAD mpcState mpcNode[MPC_HORIZON + 1];
+PER_THREAD INT32S mpcScore[MPC_ACTIONS];	//Per first half cycle, with greedy ones after it
+
+//Model inputs for the decision being searched, set by predictNextState
+PER_THREAD INT16U mpcLambda[NUM_MOVEMENTS];	//Arrival rates (mveh/ds)
+PER_THREAD INT16U mpcAllRedDs[2];			//Clearances per axis, the longest of its movements
+PER_THREAD INT16U mpcTurnYellowDs[2];
+PER_THREAD INT16U mpcGoYellowDs[2];
+PER_THREAD INT8U mpcFirstAxis;				//Axis about to get green
+
+//Serial receive ring buffer
+//Written by sciRxIsr, read by the serial task
+INT8U serialRx[SERIAL_RX_SIZE];
+INT8U serialRxHead;
+INT8U serialRxTail;
+
+//lastGood
+//Checkpoint of the last settled state
+//Kept in its own section so the startup zero fill skips it and it survives a COP reset
+//The linker parameter file must place the section in a NO_INIT segment:
+//	SEGMENTS	NO_INIT_RAM = NO_INIT 0x3F00 TO 0x3F3F;	END
+//	PLACEMENT	CHECKPOINT_DATA INTO NO_INIT_RAM;		END
+//At power on the RAM holds garbage, the magic and check fields catch that
+#pragma DATA_SEG CHECKPOINT_DATA
+PER_THREAD checkpoint lastGood;
+#pragma DATA_SEG DEFAULT
+
+//Recovery tracking
+//recovering is set from a restart request until the controller runs its threads again
+INT8U recovering;
+INT32U recoveryStart;
 
 
 /******************************************************
@@ -172,8 +820,14 @@ int main();
 //determineNextState:  Receives a state and determines the next appropriate one
 lightState determineNextState(lightState currState);
 
-//changeLighgts:  Changes the lights from their current state into the passed state
-void changeLights(lightState nextState);
+//startLightChange:  Starts changing the lights from their current state into the passed state
+void startLightChange(lightState nextState);
+
+//finishLightChange:  Ends the yellows whose clearance has run, returns 1 once none are left
+INT8U finishLightChange(INT32U elapsed);
+
+//initIntersection:  Sets up the intersection with the power on plan and all red
+void initIntersection();
 
 //initializeLights:  Initializes the LEDs to all red and sets up the ports
 void initializeLights();
@@ -181,21 +835,162 @@ void initializeLights();
 //checkSensors:  Sets the cflags variable to match the current input from the sensors
 void checkSensors();
 
-//printStatus:  Outputs the current status over the serial port in ASCII
+//printStatus:  Queues the current status for the serial port in ASCII
 void printStatus(lightState currState);  //TESTING FUNCTION
 
+//saveCheckpoint:  Records a settled light state so a warm boot can restore it
+void saveCheckpoint(lightState currState);
+
+//clearCheckpoint:  Invalidates the checkpoint while the lights are changing
+void clearCheckpoint();
+
+//restoreCheckpoint:  Drives the LEDs straight to the checkpointed state after a reset
+INT8U restoreCheckpoint();
+
+//restartController:  Restarts the controller task in place, and any stalled thread from the top
+void restartController(INT8U stalled);
+
+//kickWatchdog:  Services the COP watchdog
+void kickWatchdog();
+
+//printMetrics:  Outputs uptime and recovery metrics over the serial port
+void printMetrics();
+
+//consolePuts:  Queues a constant string for the serial task to send
+void consolePuts(const char* s);
+
+//consoleFlush:  Sends the queued console lines, serial task only
+void consoleFlush();
+
+//createController:  Creates the controller task with a painted stack
+void createController();
+
+//checkStacks:  Updates the high water mark of every task stack
+void checkStacks();
+
+//printStacks:  Outputs the stack profile of every task over the serial port
+void printStacks();
+
+//msToTicks:  Converts ms to OS ticks
+INT32U msToTicks(INT16U ms);
+
+//validatePlan:  Checks every time in a plan is within its limits
+INT8U validatePlan(timingPlan* plan);
+
+//applyPendingPlan:  Swaps in an uploaded plan, called at the cycle boundary
+void applyPendingPlan();
+
+//computeClearance:  Works out one movement's yellow and red clearance from its geometry
+INT8U computeClearance(approachGeometry* geo, INT16U* yellowMs, INT16U* redMs);
+
+//computeClearances:  Works out the clearance intervals of every movement
+void computeClearances();
+
+//decodePlan:  Reads a timing plan from its wire format
+void decodePlan(INT8U* data, timingPlan* plan);
+
+//encodePlan:  Writes a timing plan in its wire format
+void encodePlan(timingPlan* plan, INT8U* data);
+
+//buildPlanIndex:  Fills the per slot plan index from a schedule table
+INT8U buildPlanIndex(INT8U* entries, INT8U count);
+
+//minuteOfWeek:  Current minute of the week from the time of day clock
+INT16U minuteOfWeek();
+
+//schedulePlan:  Queues the next plan of the schedule, called at the cycle boundary
+void schedulePlan();
+
+//sciRxIsr:  SCI0 receive interrupt, queues the received byte
+#pragma CODE_SEG __NEAR_SEG NON_BANKED
+interrupt void sciRxIsr(void);
+#pragma CODE_SEG DEFAULT
+
+//sciPutByte:  Sends one byte over SCI0
+void sciPutByte(INT8U data);
+
+//protoRxByte:  Feeds one received byte to the frame parser
+void protoRxByte(INT8U data);
+
+//protoSendFrame:  Sends a framed reply
+void protoSendFrame(INT8U cmd, INT8U* payload, INT8U len);
+
+//protoHandleFrame:  Carries out a received command
+void protoHandleFrame(INT8U cmd, INT8U* payload, INT8U len);
+
+//sampleDetectors:  Adds one sample of the detectors to the bins
+void sampleDetectors();
+
+//protoSendBins:  Sends a run of detector bins
+void protoSendBins(INT8U kind, INT8U skip, INT8U count);
+
+//telemetryImage:  Fills image with the TELEM_FIELDS bytes telemetry reports
+void telemetryImage(INT8U* image);
+
+//telemetryPoll:  Sends a telemetry frame if anything changed
+void telemetryPoll();
+
+
+//noteServed:  Records the movements a state just finished serving
+void noteServed(lightState endState);
+
+//mpcSegment:  Runs the queues forward through one stretch of a half cycle
+void mpcSegment(mpcState* st, INT16U ds, INT8U served, INT16U* lambda);
+
+//mpcDecode:  Decodes a search action for an axis
+void mpcDecode(INT8U action, INT8U greedy, INT8U* sel, INT16U* turnMs, INT16U* goMs);
+
+//mpcHalfCycle:  Runs one half cycle of the search from a node into the next
+INT8U mpcHalfCycle(INT8U depth, INT8U action);
+
+//mpcRollout:  Scores an action followed by greedy half cycles to the horizon
+INT32S mpcRollout(INT8U depth, INT8U action);
+
+//predictNextState:  Picks the next state and its greens by searching ahead
+lightState predictNextState(lightState currState);
+
+//updateSplit:  Works out each axis' turn saturation and moves the adaptive turn and go splits
+void updateSplit();
+
+//splitGreen:  Scales a plan green by a percentage of the adaptive split
+INT16U splitGreen(INT16U ms, INT16U pct);
+
 
 /******************************************************
 			TASK PROTOTYPES
 ******************************************************/
 
-//mainLightCycle
+//controllerTask
+//Runs the light cycle and ambulance protothreads
+void controllerTask(void* PDATA);
+
+//cycleThread
 //Handles all of the main light timing and switching
-void mainLightCycle(void* PDATA);
+INT8U cycleThread(protothread* pt);
 
-//ambulanceHandler
+//ambulanceThread
 //Handles ambulance notifications
-void ambulanceHandler(void* PDATA);
+INT8U ambulanceThread(protothread* pt);
+
+//ambulanceState
+//Picks the state for an approaching ambulance
+INT8U ambulanceState(lightState* ambState);
+
+//controllerStep
+//Runs the protothreads once at a given tick with given sensor inputs
+void controllerStep(INT32U now, INT8U inputs);
+
+//supervisor
+//Watches the other tasks and services the watchdog
+void supervisor(void* PDATA);
+
+//serialHandler
+//Handles commands from the serial port
+void serialHandler(void* PDATA);
+
+//serialStep
+//Does the serial task's work for one tick
+void serialStep();
 
 
 /******************************************************
@@ -242,13 +1037,13 @@ lightState determineNextState(lightState currState)
 		
 		//If current state is all stop
 		case ALL_STOP:
-			if(cflags & NORTH_TURN_FLAG && cflags & SOUTH_TURN_FLAG)
+			if(ix->cflags & NORTH_TURN_FLAG && ix->cflags & SOUTH_TURN_FLAG)
 			//If both the north and south turn flags are set, set the next state to NS_TURN
 				nextState.lstate = NS_TURN;
-			else if(cflags & NORTH_TURN_FLAG)
+			else if(ix->cflags & NORTH_TURN_FLAG)
 				//If just the north turn flag is set
 				nextState.lstate = N_TURN;
-			else if(cflags & SOUTH_TURN_FLAG)
+			else if(ix->cflags & SOUTH_TURN_FLAG)
 				//If just the south turn flag is set
 				nextState.lstate = S_TURN;
 			else
@@ -257,11 +1052,11 @@ lightState determineNextState(lightState currState)
 			break;
 			
 		case EW_GO:
-			if(cflags & NORTH_TURN_FLAG && cflags & SOUTH_TURN_FLAG)
+			if(ix->cflags & NORTH_TURN_FLAG && ix->cflags & SOUTH_TURN_FLAG)
 				nextState.lstate = NS_TURN;
-			else if(cflags & NORTH_TURN_FLAG)
+			else if(ix->cflags & NORTH_TURN_FLAG)
 				nextState.lstate = N_TURN;
-			else if(cflags & SOUTH_TURN_FLAG)
+			else if(ix->cflags & SOUTH_TURN_FLAG)
 				nextState.lstate = S_TURN;
 			else
 				nextState.lstate = NS_GO;
@@ -282,11 +1077,11 @@ lightState determineNextState(lightState currState)
 			break;
 		
 		case NS_GO:
-			if(cflags & EAST_TURN_FLAG && cflags & WEST_TURN_FLAG)
+			if(ix->cflags & EAST_TURN_FLAG && ix->cflags & WEST_TURN_FLAG)
 				nextState.lstate = EW_TURN;
-			else if(cflags & EAST_TURN_FLAG)
+			else if(ix->cflags & EAST_TURN_FLAG)
 				nextState.lstate = E_TURN;
-			else if(cflags & WEST_TURN_FLAG)
+			else if(ix->cflags & WEST_TURN_FLAG)
 				nextState.lstate = W_TURN;
 			else
 				nextState.lstate = EW_GO;
@@ -317,13 +1112,42 @@ lightState determineNextState(lightState currState)
 		
 	
 	//Clear the flags
-	cflags = 0;
+	ix->cflags = 0;
 	
 	//Return the next state
 	return nextState;
 }
 
 
+//initIntersection
+//ix must point at zeroed storage, as it is at power on
+//Everything that does not start at 0 is set here
+void initIntersection()
+{
+	INT8U i;
+	
+	ix->plans[0] = defaultPlan;
+	ix->plans[1] = defaultPlan;
+	for(i = 0; i < NUM_PLANS; i++)
+		ix->planLibrary[i] = defaultPlan;
+	
+	ix->schedPlan = 0xFF;
+	ix->splitPct[0] = 100;
+	ix->splitPct[1] = 100;
+	ix->goPct[0] = 100;
+	ix->goPct[1] = 100;
+	for(i = 0; i < NUM_DETECTORS; i++)
+		ix->throughVph[i] = PLAN_THROUGH_VPH;
+	
+	//Initialize the LEDs
+	initializeLights();
+	
+	//Clearances for the power on plan, the first all red is a full plan all red
+	computeClearances();
+	ix->allRedClearMs = ix->plans[ix->activePlan].allRedMs;
+}
+
+
 //initializeLights
 //Initializes the port directions and sets lights to start condition
 void initializeLights()
@@ -347,10 +1171,10 @@ void initializeLights()
 }
 
 
-//changeLights
-//Receives the next lightstate and changes the lights to it
-//Handles yellow lights
-void changeLights(lightState nextState)
+//startLightChange
+//Receives the next lightstate and starts changing the lights to it
+//Lights going red are left on yellow for finishLightChange
+void startLightChange(lightState nextState)
 {
 	//******************************************
 	//Theory
@@ -359,8 +1183,8 @@ void changeLights(lightState nextState)
 		When the state is received, the first step is to compare the new state to the current state using XOR
 		After comparing, if the state for any certain light changes, we need to decide if it is changing from green to red or red to green
 		Depending on which, it either changes the light to yellow and sets a flag or changes it to green
-		It then waits several seconds for the yellow to show
-		It then transitions the remaining lights that are yellow to red and starts waiting again
+		The caller then calls finishLightChange every tick (PT_CHANGE_LIGHTS)
+		finishLightChange transitions each yellow light to red once its own clearance has run
 	
 		Furthermore, if the light opposite a light turning to green (IE. North turning to green...so south light) is passing through yellow
 			set a flag (gFlags) so that the system waits to make it green until after the opposing light has passed through yellow
@@ -368,15 +1192,18 @@ void changeLights(lightState nextState)
 	//******************************************
 	
 	
-	INT8U  	lightDiff,	//Differences between states
-			yFlags,	//Flags for lights passing through yellow
-			gFlags;	//Flags for lights waiting for opposing yellow
+	INT8U  	lightDiff;	//Differences between states
+	INT8U	i;
 	
-	//Compare desired light state to current light state and change accordingly
+	//Compare desired light state to the state on the LEDs and change accordingly
 	
 		//Set all flags to 0
-		yFlags = 0;
-		gFlags = 0;
+		ix->yFlags = 0;
+		ix->gFlags = 0;
+		
+		//The lights are not settled until finishLightChange
+		clearCheckpoint();
+		ix->lightsChanging = 1;
 		
 		/****************************************************/
 		//CRITICAL SECTION - cState CANNOT BE CHANGED
@@ -386,7 +1213,7 @@ void changeLights(lightState nextState)
 		//USE EXCLUSIVE OR (XOR) to compare states
 		//Sets all bits to 1 for lights that are changing
 		//**************************************//
-		lightDiff  = nextState.lstate ^ cState.lstate;
+		lightDiff  = nextState.lstate ^ ix->ledState.lstate;
 		
 		
 		/*Next section all the same for the most part so only the first
@@ -398,7 +1225,7 @@ void changeLights(lightState nextState)
 		//If the light is to be changed
 		if(lightDiff & TURN_NORTH)
 			//Check if the light is currently green
-			if(cState.lstate & TURN_NORTH)
+			if(ix->ledState.lstate & TURN_NORTH)
 			{
 				//Turn on the yellow light
 				PTT += LED_NORTH_TURN_YELLOW;
@@ -407,38 +1234,38 @@ void changeLights(lightState nextState)
 				PORTB -= LED_NORTH_TURN_GREEN;
 				
 				//Set the yellow flag so the system knows to change it to red later
-				yFlags += TURN_NORTH;
+				ix->yFlags += TURN_NORTH;
 			}
 			else
 				//Otherwise, turn on the green light
 				PORTB += LED_NORTH_TURN_GREEN;
 		
 		if(lightDiff & TURN_SOUTH)
-			if(cState.lstate & TURN_SOUTH)
+			if(ix->ledState.lstate & TURN_SOUTH)
 			{
 				PTT += LED_SOUTH_TURN_YELLOW;
 				PORTB -= LED_SOUTH_TURN_GREEN;
-				yFlags += TURN_SOUTH;
+				ix->yFlags += TURN_SOUTH;
 			}
 			else
 				PORTB += LED_SOUTH_TURN_GREEN;
 		
 		if(lightDiff & TURN_EAST)
-			if(cState.lstate & TURN_EAST)
+			if(ix->ledState.lstate & TURN_EAST)
 			{
 				PTT += LED_EAST_TURN_YELLOW;
 				PTH -= LED_EAST_TURN_GREEN;
-				yFlags += TURN_EAST;
+				ix->yFlags += TURN_EAST;
 			}
 			else
 				PTH += LED_EAST_TURN_GREEN;
 		
 		if(lightDiff & TURN_WEST)
-			if(cState.lstate & TURN_WEST)
+			if(ix->ledState.lstate & TURN_WEST)
 			{
 				PTT += LED_WEST_TURN_YELLOW;
 				PTH -= LED_WEST_TURN_GREEN;
-				yFlags += TURN_WEST;
+				ix->yFlags += TURN_WEST;
 			}
 			else
 				PTH += LED_WEST_TURN_GREEN;		
@@ -452,7 +1279,7 @@ void changeLights(lightState nextState)
 		//Check if the light's status is changing
 		if(lightDiff & LIGHT_NORTH)
 			//Check if the light is currently green
-			if(cState.lstate & LIGHT_NORTH)
+			if(ix->ledState.lstate & LIGHT_NORTH)
 			{
 				//Turn on yellow light
 				PTT += LED_NORTH_YELLOW;
@@ -461,15 +1288,15 @@ void changeLights(lightState nextState)
 				PORTB -= LED_NORTH_GREEN;
 				
 				//Set flag so that system knows to turn to red later
-				yFlags += LIGHT_NORTH;
+				ix->yFlags += LIGHT_NORTH;
 			}
 			//If light is currently red
 			else
 			{
 				//If the signal opposite is currently yellow
-				if(yFlags & TURN_SOUTH)
+				if(ix->yFlags & TURN_SOUTH)
 					//Set a flag to turn on the green later
-					gFlags += LIGHT_NORTH;
+					ix->gFlags += LIGHT_NORTH;
 				else
 				{
 					//Turn on the green LED
@@ -481,16 +1308,16 @@ void changeLights(lightState nextState)
 			}
 		
 		if(lightDiff & LIGHT_SOUTH)
-			if(cState.lstate & LIGHT_SOUTH)
+			if(ix->ledState.lstate & LIGHT_SOUTH)
 			{
 				PTT += LED_SOUTH_YELLOW;
 				PORTB -= LED_SOUTH_GREEN;
-				yFlags += LIGHT_SOUTH;
+				ix->yFlags += LIGHT_SOUTH;
 			}
 			else
 			{
-				if(yFlags & TURN_NORTH)
-					gFlags += LIGHT_SOUTH;
+				if(ix->yFlags & TURN_NORTH)
+					ix->gFlags += LIGHT_SOUTH;
 				else
 				{
 					PORTB += LED_SOUTH_GREEN;
@@ -499,16 +1326,16 @@ void changeLights(lightState nextState)
 			}
 		
 		if(lightDiff & LIGHT_EAST)
-			if(cState.lstate & LIGHT_EAST)
+			if(ix->ledState.lstate & LIGHT_EAST)
 			{
 				PTT += LED_EAST_YELLOW;
 				PTH -= LED_EAST_GREEN;
-				yFlags += LIGHT_EAST;
+				ix->yFlags += LIGHT_EAST;
 			}
 			else
 			{
-				if(yFlags & TURN_WEST)
-					gFlags += LIGHT_EAST;
+				if(ix->yFlags & TURN_WEST)
+					ix->gFlags += LIGHT_EAST;
 				else
 				{
 					PTH += LED_EAST_GREEN;
@@ -517,16 +1344,16 @@ void changeLights(lightState nextState)
 			}
 		
 		if(lightDiff & LIGHT_WEST)
-			if(cState.lstate & LIGHT_WEST)
+			if(ix->ledState.lstate & LIGHT_WEST)
 			{
 				PTT += LED_WEST_YELLOW;
 				PTH -= LED_WEST_GREEN;
-				yFlags += LIGHT_WEST;
+				ix->yFlags += LIGHT_WEST;
 			}
 			else
 			{
-				if(yFlags & TURN_EAST)
-					gFlags += LIGHT_WEST;
+				if(ix->yFlags & TURN_EAST)
+					ix->gFlags += LIGHT_WEST;
 				else
 				{
 					PTH += LED_WEST_GREEN;
@@ -553,10 +1380,55 @@ void changeLights(lightState nextState)
 		/*Deals with ambulance handling....the system needs to know the state
 			of the LEDs at this time*/
 		if(nextState.lstate != ALL_STOP)
-			cState = nextState;
-                
-		//Wait 2 seconds for the yellow lights
-		OSTimeDlyHMSM(0,0,2,0);
+			ix->cState = nextState;
+		
+		//The LEDs will show nextState once the yellows are done
+		ix->ledState = nextState;
+		
+		//All red after this change must clear the slowest light it stopped
+		//A change that stops nothing keeps the clearance of the one before
+		if(ix->yFlags)
+		{
+			ix->allRedClearMs = 0;
+			for(i = 0; i < NUM_DETECTORS; i++)
+			{
+				if(ix->yFlags & (TURN_NORTH >> i) && ix->redClearMs[i] > ix->allRedClearMs)
+					ix->allRedClearMs = ix->redClearMs[i];
+				if(ix->yFlags & (LIGHT_NORTH >> i) && ix->redClearMs[NUM_DETECTORS + i] > ix->allRedClearMs)
+					ix->allRedClearMs = ix->redClearMs[NUM_DETECTORS + i];
+			}
+		}
+		
+		/****************************************************/
+		//END CRITICAL SECTION
+		/****************************************************/
+		OS_EXIT_CRITICAL();
+}
+
+
+//finishLightChange
+//Called every tick while the lights are changing, elapsed is ticks since startLightChange
+//Turns the yellow lights red as their clearance runs out and the waiting lights green
+//once the opposing yellow is gone, returns 1 when the change is complete
+INT8U finishLightChange(INT32U elapsed)
+{
+		INT8U	done,	//Yellow lights whose clearance has run
+				i;
+		
+		//Find the yellows that are due
+		done = 0;
+		for(i = 0; i < NUM_DETECTORS; i++)
+		{
+			if(ix->yFlags & (TURN_NORTH >> i) && elapsed >= msToTicks(ix->yellowClearMs[i]))
+				done |= TURN_NORTH >> i;
+			if(ix->yFlags & (LIGHT_NORTH >> i) && elapsed >= msToTicks(ix->yellowClearMs[NUM_DETECTORS + i]))
+				done |= LIGHT_NORTH >> i;
+		}
+		
+		/****************************************************/
+		//CRITICAL SECTION - LEDs CANNOT BE CHANGED
+		/****************************************************/
+		OS_ENTER_CRITICAL();
 		
 		/*DEBUG CODE
 		puts("\nMIDDLEOFYELLOW\n");
@@ -569,8 +1441,8 @@ void changeLights(lightState nextState)
 		
 		//Check for yellow lights
 		
-		//If the yellow LED is on
-		if(yFlags & LIGHT_NORTH)
+		//If the yellow LED is due to end
+		if(done & LIGHT_NORTH)
 		{
 			//Turn off yellow LED
 			PTT -= LED_NORTH_YELLOW;
@@ -579,17 +1451,17 @@ void changeLights(lightState nextState)
 			PORTB += LED_NORTH_RED;
 		}
 
-		if(yFlags & LIGHT_SOUTH)
+		if(done & LIGHT_SOUTH)
 		{
 			PTT -= LED_SOUTH_YELLOW;
 			PORTB += LED_SOUTH_RED;
 		}
-		if(yFlags & LIGHT_EAST)
+		if(done & LIGHT_EAST)
 		{
 			PTT -= LED_EAST_YELLOW;
 			PTH += LED_EAST_RED;
 		}
-		if(yFlags & LIGHT_WEST)
+		if(done & LIGHT_WEST)
 		{
 			PTT -= LED_WEST_YELLOW;
 			PTH += LED_WEST_RED;
@@ -597,14 +1469,16 @@ void changeLights(lightState nextState)
 		
 		//Turn signals have no red LEDs, just yellow
 		
-		if(yFlags & TURN_NORTH)
+		if(done & TURN_NORTH)
 			PTT -= LED_NORTH_TURN_YELLOW;
-		if(yFlags & TURN_SOUTH)
+		if(done & TURN_SOUTH)
 			PTT -= LED_SOUTH_TURN_YELLOW;
-		if(yFlags & TURN_EAST)
+		if(done & TURN_EAST)
 			PTT -= LED_EAST_TURN_YELLOW;
-		if(yFlags & TURN_WEST)
+		if(done & TURN_WEST)
 			PTT -= LED_WEST_TURN_YELLOW;
+		
+		ix->yFlags &= ~done;
 
 		/*Next section all the same for the most part so only the first
 			segment is commented*/
@@ -612,32 +1486,38 @@ void changeLights(lightState nextState)
 		//Next section is green flags
 		//Deals with a car opposite a changing light
 		
-		//If the green flag is set
-		if(gFlags & LIGHT_NORTH)
+		//If the green flag is set and the opposing turn is no longer yellow
+		if(ix->gFlags & LIGHT_NORTH && !(ix->yFlags & TURN_SOUTH))
 		{
 			//Turn on the green LED
 			PORTB += LED_NORTH_GREEN;
 			
 			//Turn off the red LED
 			PORTB -= LED_NORTH_RED;
+			
+			//Done waiting
+			ix->gFlags -= LIGHT_NORTH;
 		}
 
-		if(gFlags & LIGHT_SOUTH)
+		if(ix->gFlags & LIGHT_SOUTH && !(ix->yFlags & TURN_NORTH))
 		{
 			PORTB += LED_SOUTH_GREEN;
 			PORTB -= LED_SOUTH_RED;
+			ix->gFlags -= LIGHT_SOUTH;
 		}
 
-		if(gFlags & LIGHT_EAST)
+		if(ix->gFlags & LIGHT_EAST && !(ix->yFlags & TURN_WEST))
 		{
 			PTH += LED_EAST_GREEN;
 			PTH -= LED_EAST_RED;
+			ix->gFlags -= LIGHT_EAST;
 		}
 
-		if(gFlags & LIGHT_WEST)
+		if(ix->gFlags & LIGHT_WEST && !(ix->yFlags & TURN_EAST))
 		{
 			PTH += LED_WEST_GREEN;
 			PTH -= LED_WEST_RED;
+			ix->gFlags -= LIGHT_WEST;
 		}
 
 
@@ -646,8 +1526,15 @@ void changeLights(lightState nextState)
 		/****************************************************/
 		OS_EXIT_CRITICAL();
 		
-		//Return to main task
-		return;
+		//Still lights on yellow
+		if(ix->yFlags)
+			return 0;
+		
+		//The LEDs now show ledState, remember it for a warm boot
+		ix->lightsChanging = 0;
+		saveCheckpoint(ix->ledState);
+		
+		return 1;
 }
 
 
@@ -656,249 +1543,2104 @@ void changeLights(lightState nextState)
 void checkSensors()
 {
 
-     cflags = PORTA;
+     ix->cflags = ix->schedInputs;
 }
 
 
-/******************************************************
-			TASK DEFINITIONS
-******************************************************/
-
-//MainLightCycle
-//Handles the main cycle between states
-void MainLightCycle(void* pdata)
+//saveCheckpoint
+//Records the state currently on the LEDs
+void saveCheckpoint(lightState currState)
 {
+	OS_ENTER_CRITICAL();
 	
-	//Debug output code
-	puts("\nENTERING MAIN LIGHT CYCLE TASK\n");
+	lastGood.state = currState;
+	lastGood.check = ~(currState.lstate ^ currState.astate);
+	lastGood.settled = 1;
+	
+	OS_EXIT_CRITICAL();
+}
+
 
+//clearCheckpoint
+//Invalidates the checkpoint
+//A reset during a yellow must not jump straight back to green
+void clearCheckpoint()
+{
+	lastGood.settled = 0;
+}
+
+
+//restoreCheckpoint
+//Called once from main() after initializeLights
+//If the checkpoint is valid, drives the LEDs straight to the saved state
+//Returns 1 on a warm boot, 0 on a cold boot
+INT8U restoreCheckpoint()
+{
+	INT8U lstate;
+	
+	//If the magic is gone this is a power on and the whole checkpoint is garbage
+	if(lastGood.magic != CHECKPOINT_MAGIC)
+	{
+		lastGood.magic = CHECKPOINT_MAGIC;
+		lastGood.settled = 0;
+		lastGood.coldBoots = 0;
+		lastGood.warmBoots = 0;
+	}
 	
-	lightState 	nextState,	//Holder for the next state
-			stopState;	//Blank all red state
+	//Check the saved state survived the reset intact
+	if(!lastGood.settled
+		|| lastGood.check != (INT8U)~(lastGood.state.lstate ^ lastGood.state.astate)
+		|| lastGood.state.lstate == ALL_STOP)
+	{
+		//Nothing worth restoring, the LEDs are already all red
+		lastGood.settled = 0;
+		lastGood.coldBoots++;
+		return 0;
+	}
+	
+	lstate = lastGood.state.lstate;
+	
+	//The reset only blanked the LEDs for a few milliseconds
+	//so the saved state goes back on directly, without yellows
+	
+	//Each light is either green or red
+	PORTB = (lstate & LIGHT_NORTH ? LED_NORTH_GREEN : LED_NORTH_RED)
+		+ (lstate & LIGHT_SOUTH ? LED_SOUTH_GREEN : LED_SOUTH_RED)
+		+ (lstate & TURN_NORTH ? LED_NORTH_TURN_GREEN : 0)
+		+ (lstate & TURN_SOUTH ? LED_SOUTH_TURN_GREEN : 0);
+	
+	PTH = (lstate & LIGHT_EAST ? LED_EAST_GREEN : LED_EAST_RED)
+		+ (lstate & LIGHT_WEST ? LED_WEST_GREEN : LED_WEST_RED)
+		+ (lstate & TURN_EAST ? LED_EAST_TURN_GREEN : 0)
+		+ (lstate & TURN_WEST ? LED_WEST_TURN_GREEN : 0);
+	
+	//No yellows in a settled state
+	PTT = 0;
+	
+	//Walk lights follow the go states
+	if(lstate == NS_GO)
+		PORTK = LED_WALK_NS_WHITE;
+	else if(lstate == EW_GO)
+		PORTK = LED_WALK_EW_WHITE;
+	else
+		PORTK = 0;
+	
+	ix->cState = lastGood.state;
+	ix->ledState = lastGood.state;
+	lastGood.warmBoots++;
+	
+	return 1;
+}
 
 
-	//Setup all red state
-	stopState.lstate = ALL_STOP;
-	stopState.astate = 0;
+//restartController
+//Restarts the controller task in place
+//Same priority and same stack, so nothing leaks however often it happens
+//Threads still making progress keep their place, the stalled ones start again from the top
+void restartController(INT8U stalled)
+{
+	//Note when recovery started so the new task can report how long it took
+	recoveryStart = OSTimeGet();
+	recovering = 1;
+	ix->ctrlMetrics.restarts++;
 	
-	//Clear the sensors
-	cflags = 0;
-    
-	//Main cycle
-	while(1)
+	//Remove the old task before touching what it was running
+	OSTaskDel(CONTROLLER_TASK_PRIO);
+	
+	//Any yellows left on have long run their time, finish the change first
+	//so a thread starting over changes the lights from what is really showing
+	if(ix->lightsChanging)
+		finishLightChange(0xFFFFFFFF);
+	
+	//The light cycle goes through all red from whatever is showing
+	if(stalled & STALL_CYCLE)
+		ix->cyclePt.lc = 0;
+	
+	//The light cycle gets the lights back where it left off
+	if(stalled & STALL_AMBULANCE)
 	{
-		//Change all of the lights to red
-		//NOTE:  cState is NOT changed here
-		//This is purely an INTERMEDIATE state
-		changeLights(stopState);
-		
-		//Wait for a period
-		OSTimeDlyHMSM(0,0,3,0);
+		ix->ambulancePt.lc = 0;
+		ix->preemptRequest = 0;
+	}
+	
+	//Both threads get a fresh start on the stall check
+	ix->cyclePt.progress = recoveryStart;
+	ix->ambulancePt.progress = recoveryStart;
+	
+	createController();
+}
 
-		//Determine the next state after the current state
-		nextState = determineNextState(cState);
-		
-		//Set cState to stopState so that LEDs change appropriately
-		//Already determined next state so cState doesn't need to reflect actual state
-		cState = stopState;
-		
-		//Change the lights to the next state
-		changeLights(nextState);
-		
-		//When done changing lights, change current state to reflect
-		cState = nextState;
-		
-		//DEBUG:  Print the current state
-		printStatus(cState);
 
-		//Turn signal handling
-		//Since the waiting time is different for go states and turn states
+//createController
+//Creates the controller task
+//The stack is painted so its high water mark can be measured
+void createController()
+{
+	OSTaskCreateExt(controllerTask, (void *) 1, &controllerStk[CONTROLLER_STK_SIZE], CONTROLLER_TASK_PRIO,
+		CONTROLLER_TASK_PRIO, &controllerStk[0], CONTROLLER_STK_SIZE, (void *) 0,
+		OS_TASK_OPT_STK_CHK | OS_TASK_OPT_STK_CLR);
+}
+
+
+//checkStacks
+//Measures how much of each painted stack has been used
+//Keeps the highest value, a restart repaints the controller stack
+void checkStacks()
+{
+	OS_STK_DATA stkData;
+	INT8U i;
+	
+	for(i = 0; i < NUM_TASKS; i++)
+	{
+		if(OSTaskStkChk(taskStacks[i].prio, &stkData) != OS_NO_ERR)
+			continue;
 		
-		//If there is a turning state active (IE. not a GO state)
-		if(cState.lstate != EW_GO && cState.lstate != NS_GO)
-		{
-			//Wait a period with the turning light green
-			OSTimeDlyHMSM(0,0,4,0);
-			
-			//Determine the next state
-			nextState = determineNextState(cState);
-			
-			//DEBUG CODE
-			//puts("\nTURN STATE\n");
-			
-			//Change the lights
-			changeLights(nextState);
-			
-			//Set the current state to reflect change
-			cState = nextState;
-			
-			//DEBUG:  Print current state
-			printStatus(cState);
-			
-			//Wait a period with the go light green
-			OSTimeDlyHMSM(0,0,7,0);
-		}
-		else
-			//If not a turning state, wait a period with lights green
-			OSTimeDlyHMSM(0,0,10,0);
+		if(stkData.OSUsed > taskStacks[i].maxUsed)
+			taskStacks[i].maxUsed = (INT16U)stkData.OSUsed;
 	}
 }
 
-//AmbulanceHandler task
-//Handles when an ambulance is detected
-//Higher priority than mainLightCycle
-void ambulanceHandler(void* PDATA)
+
+//printStacks
+//Outputs used/size for every task
+//Flags any task that has eaten into its margin
+void printStacks()
 {
-	//DEBUG:  Print code signalling task start
-	printf("\nENTERING AMBULANCE HANDLER\n");
-     
-	lightState 	stopState,	//All red state
-			nextState;	//Next state holder
+	INT8U i;
+	
+	for(i = 0; i < NUM_TASKS; i++)
+	{
+		printf("STACK %s %u/%u%s\n",
+			taskStacks[i].name,
+			taskStacks[i].maxUsed,
+			taskStacks[i].size,
+			taskStacks[i].maxUsed > taskStacks[i].size - STK_MARGIN ? " IN MARGIN" : "");
+	}
+}
+
+
+//msToTicks
+//Converts ms to OS ticks for PT_DELAY
+INT32U msToTicks(INT16U ms)
+{
+	return (INT32U)ms * OS_TICKS_PER_SEC / 1000;
+}
+
+
+//validatePlan
+//Returns 1 if every time in the plan is within its limits
+INT8U validatePlan(timingPlan* plan)
+{
+	if(plan->allRedMs < PLAN_MIN_ALL_RED_MS || plan->allRedMs > PLAN_MAX_ALL_RED_MS)
+		return 0;
+	if(plan->yellowMs < PLAN_MIN_YELLOW_MS || plan->yellowMs > PLAN_MAX_YELLOW_MS)
+		return 0;
+	if(plan->goMs < PLAN_MIN_GREEN_MS || plan->goMs > PLAN_MAX_GREEN_MS)
+		return 0;
+	if(plan->turnMs < PLAN_MIN_GREEN_MS || plan->turnMs > PLAN_MAX_GREEN_MS)
+		return 0;
+	if(plan->turnGoMs < PLAN_MIN_GREEN_MS || plan->turnGoMs > PLAN_MAX_GREEN_MS)
+		return 0;
+	
+	return 1;
+}
+
+
+//applyPendingPlan
+//Called by the main cycle at the top of every cycle
+//Switching the index is the whole swap, so the cycle never sees half a plan
+//The clearances are worked out again here too, so they always match the plan running
+void applyPendingPlan()
+{
+	if(!ix->planPending && !ix->geometryPending)
+		return;
+	
+	if(ix->planPending)
+	{
+		OS_ENTER_CRITICAL();
+		ix->activePlan ^= 1;
+		ix->planPending = 0;
+		OS_EXIT_CRITICAL();
+		
+		consolePuts("\nNEW TIMING PLAN\n");
+	}
+	
+	ix->geometryPending = 0;
+	computeClearances();
+}
+
+
+//computeClearance
+//Yellow and red clearance for one movement from its geometry (ms)
+//Returns 0 if either is longer than the plan limits allow
+//Anything shorter than the limits is brought up to them
+INT8U computeClearance(approachGeometry* geo, INT16U* yellowMs, INT16U* redMs)
+{
+	INT32U	yellow,
+			red;
+	
+	//v / (2a + 2Gg) with v = mph * 22 / 15 ft/s and G in percent, in ms
+	//20000 + 644 * G is 1000 * (2a + 2Gg)
+	yellow = 1000 + (INT32U)geo->speedMph * 22000000UL
+		/ (15 * (INT32U)(20000 + 644 * (INT16S)geo->gradePct));
+	
+	//(W + L) / v in ms
+	red = ((INT32U)geo->widthFt + CLEAR_VEHICLE_FT) * 15000 / ((INT32U)geo->speedMph * 22);
+	
+	if(yellow > PLAN_MAX_YELLOW_MS || red > PLAN_MAX_ALL_RED_MS)
+		return 0;
+	
+	*yellowMs = yellow < PLAN_MIN_YELLOW_MS ? PLAN_MIN_YELLOW_MS : (INT16U)yellow;
+	*redMs = red < PLAN_MIN_ALL_RED_MS ? PLAN_MIN_ALL_RED_MS : (INT16U)red;
+	
+	return 1;
+}
+
+
+//computeClearances
+//Fills yellowClearMs and redClearMs for the active plan
+//Movements with no geometry get the plan's yellow and all red
+void computeClearances()
+{
+	approachGeometry geo;
+	INT8U m;
+	
+	for(m = 0; m < NUM_MOVEMENTS; m++)
+	{
+		//The serial task may be writing the table
+		OS_ENTER_CRITICAL();
+		geo = ix->geometry[m];
+		OS_EXIT_CRITICAL();
+		
+		//Stored geometry has already passed computeClearance
+		if(!geo.speedMph || !computeClearance(&geo, &ix->yellowClearMs[m], &ix->redClearMs[m]))
+		{
+			ix->yellowClearMs[m] = ix->plans[ix->activePlan].yellowMs;
+			ix->redClearMs[m] = ix->plans[ix->activePlan].allRedMs;
+		}
+	}
+}
+
+
+//decodePlan
+//Wire order is the order of the timingPlan fields
+void decodePlan(INT8U* data, timingPlan* plan)
+{
+	plan->allRedMs = ((INT16U)data[0] << 8) | data[1];
+	plan->yellowMs = ((INT16U)data[2] << 8) | data[3];
+	plan->goMs = ((INT16U)data[4] << 8) | data[5];
+	plan->turnMs = ((INT16U)data[6] << 8) | data[7];
+	plan->turnGoMs = ((INT16U)data[8] << 8) | data[9];
+}
+
+
+//encodePlan
+//Wire order is the order of the timingPlan fields
+void encodePlan(timingPlan* plan, INT8U* data)
+{
+	data[0] = plan->allRedMs >> 8;
+	data[1] = plan->allRedMs;
+	data[2] = plan->yellowMs >> 8;
+	data[3] = plan->yellowMs;
+	data[4] = plan->goMs >> 8;
+	data[5] = plan->goMs;
+	data[6] = plan->turnMs >> 8;
+	data[7] = plan->turnMs;
+	data[8] = plan->turnGoMs >> 8;
+	data[9] = plan->turnGoMs;
+}
+
+
+//buildPlanIndex
+//Each entry is: day mask (bit 0 = Sunday), plan ID, start minute of the day
+//An entry's plan runs from its start until the next entry starts, wrapping
+//round the end of the week. Later entries win when two start together.
+//Returns 0 without touching the index if any entry is bad
+INT8U buildPlanIndex(INT8U* entries, INT8U count)
+{
+	INT16U	slot,			//Slot being filled
+			start;			//Start minute of an entry
+	INT8U	i,
+			day,
+			carry;			//Plan running into the current slot
+	
+	//Check everything first so a bad table leaves the old one running
+	for(i = 0; i < count; i++)
+	{
+		start = ((INT16U)entries[i * SCHEDULE_ENTRY_SIZE + 2] << 8) | entries[i * SCHEDULE_ENTRY_SIZE + 3];
+		
+		if(entries[i * SCHEDULE_ENTRY_SIZE + 1] >= NUM_PLANS
+			|| start >= 24 * 60
+			|| start % SLOT_MINUTES)
+			return 0;
+	}
+	
+	//The controller can run in the middle of the rebuild
+	//and skips the schedule until the caller turns it back on
+	ix->scheduleLoaded = 0;
+	
+	//0xFF marks a slot where no entry starts
+	for(slot = 0; slot < SLOTS_PER_WEEK; slot++)
+		ix->planIndex[slot] = 0xFF;
+	
+	//Mark the slots where entries start
+	for(i = 0; i < count; i++)
+	{
+		start = ((INT16U)entries[i * SCHEDULE_ENTRY_SIZE + 2] << 8) | entries[i * SCHEDULE_ENTRY_SIZE + 3];
+		
+		for(day = 0; day < 7; day++)
+			if(entries[i * SCHEDULE_ENTRY_SIZE] & (1 << day))
+				ix->planIndex[day * SLOTS_PER_DAY + start / SLOT_MINUTES] = entries[i * SCHEDULE_ENTRY_SIZE + 1];
+	}
+	
+	//The week starts with whatever the last entry of the week left running
+	//With no entries at all the power on plan runs all week
+	carry = 0;
+	for(slot = SLOTS_PER_WEEK; slot > 0; slot--)
+		if(ix->planIndex[slot - 1] != 0xFF)
+		{
+			carry = ix->planIndex[slot - 1];
+			break;
+		}
+	
+	//Carry each plan forward to the next start
+	for(slot = 0; slot < SLOTS_PER_WEEK; slot++)
+	{
+		if(ix->planIndex[slot] != 0xFF)
+			carry = ix->planIndex[slot];
+		ix->planIndex[slot] = carry;
+	}
+	
+	return 1;
+}
+
+
+//minuteOfWeek
+//Minutes since Sunday 00:00 by the time of day clock
+INT16U minuteOfWeek()
+{
+	INT32U elapsed;
+	
+	elapsed = (OSTimeGet() - ix->clockBaseTicks) / (60 * (INT32U)OS_TICKS_PER_SEC);
+	
+	return (INT16U)((ix->clockBaseMinute + elapsed) % MINUTES_PER_WEEK);
+}
+
+
+//schedulePlan
+//Called by the main cycle at the top of every cycle, before applyPendingPlan
+//When the schedule moves to a new plan the times are blended over
+//PLAN_TRANSITION_CYCLES cycles instead of jumping in one go
+void schedulePlan()
+{
+	timingPlan* to;
+	timingPlan step;
+	INT8U plan;
+	
+	if(!ix->scheduleLoaded || !ix->clockSet)
+		return;
+	
+	//Look up the plan for this slot of the week
+	plan = ix->planIndex[minuteOfWeek() / SLOT_MINUTES];
+	
+	//Start a new blend from whatever is running now
+	if(plan != ix->schedPlan)
+	{
+		ix->schedPlan = plan;
+		ix->transFrom = ix->plans[ix->activePlan];
+		ix->transStep = 1;
+	}
+	
+	if(!ix->transStep)
+		return;
+	
+	//Each field moves a share of the way towards the new plan
+	//Both ends are valid plans so every step between them is too
+	to = &ix->planLibrary[ix->schedPlan];
+	step.allRedMs = ix->transFrom.allRedMs + ((INT32S)to->allRedMs - ix->transFrom.allRedMs) * ix->transStep / PLAN_TRANSITION_CYCLES;
+	step.yellowMs = ix->transFrom.yellowMs + ((INT32S)to->yellowMs - ix->transFrom.yellowMs) * ix->transStep / PLAN_TRANSITION_CYCLES;
+	step.goMs = ix->transFrom.goMs + ((INT32S)to->goMs - ix->transFrom.goMs) * ix->transStep / PLAN_TRANSITION_CYCLES;
+	step.turnMs = ix->transFrom.turnMs + ((INT32S)to->turnMs - ix->transFrom.turnMs) * ix->transStep / PLAN_TRANSITION_CYCLES;
+	step.turnGoMs = ix->transFrom.turnGoMs + ((INT32S)to->turnGoMs - ix->transFrom.turnGoMs) * ix->transStep / PLAN_TRANSITION_CYCLES;
+	
+	if(ix->transStep >= PLAN_TRANSITION_CYCLES)
+		ix->transStep = 0;
+	else
+		ix->transStep++;
+	
+	//Hand the step over through the spare slot like an upload
+	OS_ENTER_CRITICAL();
+	ix->plans[ix->activePlan ^ 1] = step;
+	ix->planPending = 1;
+	OS_EXIT_CRITICAL();
+}
+
+
+//sciRxIsr
+//SCI0 receive interrupt, the vector number (20, 0xFFD6, from the derivative
+//header) puts it in the vector table and makes it return with RTI,
+//interrupt functions must not be banked
+//Uses no OS services so it needs no OSIntEnter/OSIntExit
+//Bytes that arrive with the buffer full are dropped, the checksum catches it
+#pragma CODE_SEG __NEAR_SEG NON_BANKED
+interrupt VectorNumber_Vsci0 void sciRxIsr(void)
+{
+	INT8U data;
+	INT8U next;
+	
+	//Reading SR1 then DRL clears RDRF
+	if(!(SCI0SR1 & SCI_RDRF))
+		return;
+	data = SCI0DRL;
+	
+	next = (serialRxHead + 1) & (SERIAL_RX_SIZE - 1);
+	if(next != serialRxTail)
+	{
+		serialRx[serialRxHead] = data;
+		serialRxHead = next;
+	}
+}
+#pragma CODE_SEG DEFAULT
+
+
+//sciPutByte
+//Waits for the transmitter and sends a byte
+void sciPutByte(INT8U data)
+{
+	while(!(SCI0SR1 & SCI_TDRE))
+		;
+	SCI0DRL = data;
+}
+
+
+//protoSendFrame
+//Sends SYNC LEN CMD PAYLOAD CHK
+void protoSendFrame(INT8U cmd, INT8U* payload, INT8U len)
+{
+	INT8U sum;
+	INT8U i;
+	
+	sciPutByte(PROTO_SYNC);
+	sciPutByte(len);
+	sciPutByte(cmd);
+	sum = len + cmd;
+	
+	for(i = 0; i < len; i++)
+	{
+		sciPutByte(payload[i]);
+		sum += payload[i];
+	}
+	
+	//Make the sum come out to 0
+	sciPutByte((INT8U)(0 - sum));
+}
+
+
+//protoRxByte
+//Frame parser, one byte at a time
+//Any bad frame just sends the parser back to looking for SYNC
+void protoRxByte(INT8U data)
+{
+	//Parser states
+	enum {WAIT_SYNC, WAIT_LEN, WAIT_CMD, WAIT_PAYLOAD, WAIT_CHK};
+	
+	static INT8U state = WAIT_SYNC;
+	static INT8U len, cmd, count, sum;
+	static INT8U payload[PROTO_MAX_PAYLOAD];
+	
+	switch(state){
+		
+		case WAIT_SYNC:
+			if(data == PROTO_SYNC)
+				state = WAIT_LEN;
+			break;
+		
+		case WAIT_LEN:
+			//Too long to be ours, start over
+			if(data > PROTO_MAX_PAYLOAD)
+			{
+				state = WAIT_SYNC;
+				break;
+			}
+			len = data;
+			sum = data;
+			state = WAIT_CMD;
+			break;
+		
+		case WAIT_CMD:
+			cmd = data;
+			sum += data;
+			count = 0;
+			state = len ? WAIT_PAYLOAD : WAIT_CHK;
+			break;
+		
+		case WAIT_PAYLOAD:
+			payload[count++] = data;
+			sum += data;
+			if(count == len)
+				state = WAIT_CHK;
+			break;
+		
+		case WAIT_CHK:
+			//Only act on frames that add up
+			if((INT8U)(sum + data) == 0)
+				protoHandleFrame(cmd, payload, len);
+			state = WAIT_SYNC;
+			break;
+	}
+}
+
+
+//protoHandleFrame
+//Carries out a command and sends the reply
+void protoHandleFrame(INT8U cmd, INT8U* payload, INT8U len)
+{
+	timingPlan newPlan;
+	approachGeometry newGeometry[NUM_MOVEMENTS];
+	INT16U minute,
+			yellowMs,
+			redMs;
+	INT8U reply[PLAN_WIRE_SIZE];
+	INT8U i;
+	
+	switch(cmd){
+		
+		//Upload a timing plan into the spare slot
+		case CMD_PLAN_UPLOAD:
+			if(len != PLAN_WIRE_SIZE)
+			{
+				reply[0] = PROTO_NAK_LENGTH;
+				break;
+			}
+			
+			decodePlan(payload, &newPlan);
+			
+			if(!validatePlan(&newPlan))
+			{
+				reply[0] = PROTO_NAK_RANGE;
+				break;
+			}
+			
+			//The main cycle only reads plans[activePlan], the spare slot is ours
+			//A second upload before the swap simply replaces the first
+			OS_ENTER_CRITICAL();
+			ix->plans[ix->activePlan ^ 1] = newPlan;
+			ix->planPending = 1;
+			OS_EXIT_CRITICAL();
+			
+			reply[0] = PROTO_ACK;
+			break;
+		
+		//Report the plan currently running
+		case CMD_PLAN_QUERY:
+			encodePlan(&ix->plans[ix->activePlan], reply);
+			protoSendFrame(cmd | PROTO_REPLY, reply, PLAN_WIRE_SIZE);
+			return;
+		
+		//Store a plan in the library for the scheduler
+		case CMD_PLAN_STORE:
+			if(len != PLAN_WIRE_SIZE + 1)
+			{
+				reply[0] = PROTO_NAK_LENGTH;
+				break;
+			}
+			
+			decodePlan(payload + 1, &newPlan);
+			
+			if(payload[0] >= NUM_PLANS || !validatePlan(&newPlan))
+			{
+				reply[0] = PROTO_NAK_RANGE;
+				break;
+			}
+			
+			//A blend towards this plan picks up the new times on its next step
+			//If the plan is already scheduled, forgetting it starts a new blend into it
+			OS_ENTER_CRITICAL();
+			ix->planLibrary[payload[0]] = newPlan;
+			if(payload[0] == ix->schedPlan)
+				ix->schedPlan = 0xFF;
+			OS_EXIT_CRITICAL();
+			
+			reply[0] = PROTO_ACK;
+			break;
+		
+		//Replace the whole schedule
+		case CMD_SCHEDULE_SET:
+			if(len % SCHEDULE_ENTRY_SIZE || len / SCHEDULE_ENTRY_SIZE > MAX_SCHEDULE_ENTRIES)
+			{
+				reply[0] = PROTO_NAK_LENGTH;
+				break;
+			}
+			
+			//buildPlanIndex turns the scheduler off while it rewrites the index
+			if(buildPlanIndex(payload, len / SCHEDULE_ENTRY_SIZE))
+			{
+				ix->scheduleLoaded = 1;
+				reply[0] = PROTO_ACK;
+			}
+			else
+				reply[0] = PROTO_NAK_RANGE;
+			break;
+		
+		//Set the time of day clock
+		case CMD_CLOCK_SET:
+			if(len != 3)
+			{
+				reply[0] = PROTO_NAK_LENGTH;
+				break;
+			}
+			
+			minute = ((INT16U)payload[1] << 8) | payload[2];
+			if(payload[0] >= 7 || minute >= 24 * 60)
+			{
+				reply[0] = PROTO_NAK_RANGE;
+				break;
+			}
+			
+			OS_ENTER_CRITICAL();
+			ix->clockBaseMinute = payload[0] * 24 * 60 + minute;
+			ix->clockBaseTicks = OSTimeGet();
+			ix->clockSet = 1;
+			OS_EXIT_CRITICAL();
+			
+			reply[0] = PROTO_ACK;
+			break;
+		
+		//Read back detector bins
+		case CMD_BINS_GET:
+			if(len != 3)
+			{
+				reply[0] = PROTO_NAK_LENGTH;
+				break;
+			}
+			
+			if(payload[0] != BIN_MINUTE && payload[0] != BIN_QUARTER)
+			{
+				reply[0] = PROTO_NAK_RANGE;
+				break;
+			}
+			
+			protoSendBins(payload[0], payload[1], payload[2]);
+			return;
+		
+		//Pick how the cycle chooses its states, takes effect at the next decision
+		case CMD_MODE_SET:
+			if(len != 1)
+			{
+				reply[0] = PROTO_NAK_LENGTH;
+				break;
+			}
+			
+			if(payload[0] != MODE_FIXED && payload[0] != MODE_PREDICTIVE && payload[0] != MODE_ADAPTIVE)
+			{
+				reply[0] = PROTO_NAK_RANGE;
+				break;
+			}
+			
+			ix->phaseMode = payload[0];
+			reply[0] = PROTO_ACK;
+			break;
+		
+		//Replace the approach geometry, takes effect at the top of the next cycle
+		case CMD_GEOMETRY_SET:
+			if(len != NUM_MOVEMENTS * GEOMETRY_WIRE_SIZE)
+			{
+				reply[0] = PROTO_NAK_LENGTH;
+				break;
+			}
+			
+			//Check every movement before storing any of them
+			reply[0] = PROTO_ACK;
+			for(i = 0; i < NUM_MOVEMENTS; i++)
+			{
+				newGeometry[i].speedMph = payload[i * GEOMETRY_WIRE_SIZE];
+				newGeometry[i].gradePct = (INT8S)payload[i * GEOMETRY_WIRE_SIZE + 1];
+				newGeometry[i].widthFt = payload[i * GEOMETRY_WIRE_SIZE + 2];
+				
+				if(!newGeometry[i].speedMph)
+					continue;
+				
+				if(newGeometry[i].speedMph < MIN_APPROACH_MPH || newGeometry[i].speedMph > MAX_APPROACH_MPH
+					|| newGeometry[i].gradePct < -MAX_GRADE_PCT || newGeometry[i].gradePct > MAX_GRADE_PCT
+					|| !computeClearance(&newGeometry[i], &yellowMs, &redMs))
+					reply[0] = PROTO_NAK_RANGE;
+			}
+			
+			if(reply[0] != PROTO_ACK)
+				break;
+			
+			OS_ENTER_CRITICAL();
+			for(i = 0; i < NUM_MOVEMENTS; i++)
+				ix->geometry[i] = newGeometry[i];
+			ix->geometryPending = 1;
+			OS_EXIT_CRITICAL();
+			break;
+		
+		//Replace the through demand, the search and the split use it from their next update
+		case CMD_DEMAND_SET:
+			if(len != NUM_DETECTORS * 2)
+			{
+				reply[0] = PROTO_NAK_LENGTH;
+				break;
+			}
+			
+			reply[0] = PROTO_ACK;
+			for(i = 0; i < NUM_DETECTORS; i++)
+				if(((INT16U)payload[i * 2] << 8 | payload[i * 2 + 1]) > MAX_THROUGH_VPH)
+					reply[0] = PROTO_NAK_RANGE;
+			
+			if(reply[0] != PROTO_ACK)
+				break;
+			
+			//The controller reads these, so all four change at once
+			OS_ENTER_CRITICAL();
+			for(i = 0; i < NUM_DETECTORS; i++)
+				ix->throughVph[i] = (INT16U)payload[i * 2] << 8 | payload[i * 2 + 1];
+			OS_EXIT_CRITICAL();
+			break;
+		
+		default:
+			reply[0] = PROTO_NAK_UNKNOWN;
+			break;
+	}
+	
+	//Status reply
+	protoSendFrame(cmd | PROTO_REPLY, reply, 1);
+}
+
+
+//sampleDetectors
+//Called every controller step
+//Counts a vehicle each time a detector turns on and the samples it is on for
+//Every minute the counts close into a minute bin, every 15 minutes into a quarter bin
+void sampleDetectors()
+{
+	INT8U	det,			//Detector bits now
+			rising,			//Detectors that just turned on
+			i;
+	minuteBin* mBin;
+	quarterBin* qBin;
+	
+	det = ix->schedInputs & DETECTOR_MASK;
+	rising = det & ~ix->detLast;
+	ix->detLast = det;
+	
+	//Detector i is PORTA bit i
+	for(i = 0; i < NUM_DETECTORS; i++)
+	{
+		if(det & (1 << i))
+			ix->detOnSamples[i]++;
+		if(rising & (1 << i) && ix->detVolume[i] < 255)
+			ix->detVolume[i]++;
+	}
+	
+	//Saturation for the adaptive split, detectors 0-1 are NS and 2-3 EW
+	//Each detector only counts while its own turn is green
+	for(i = 0; i < NUM_DETECTORS; i++)
+	{
+		if(ix->ledState.lstate & (TURN_NORTH >> i) && ix->splitGreenSamples[i / 2] < 0x7FFF)
+		{
+			ix->splitGreenSamples[i / 2]++;
+			if(det & (1 << i))
+				ix->splitOccSamples[i / 2]++;
+		}
+	}
+	if(ix->ledState.lstate & NS_MOVEMENTS)
+		ix->splitServed |= 1;
+	if(ix->ledState.lstate & EW_MOVEMENTS)
+		ix->splitServed |= 2;
+	
+	if(++ix->detSamples < SAMPLES_PER_MINUTE)
+		return;
+	
+	//Close the minute
+	//Readers copy bins in a critical section, so fill this one in one too
+	OS_ENTER_CRITICAL();
+	
+	mBin = &ix->minuteBins[ix->minuteCount % MINUTE_BINS];
+	for(i = 0; i < NUM_DETECTORS; i++)
+	{
+		mBin->volume[i] = ix->detVolume[i];
+		mBin->occupancy[i] = (INT8U)((INT32U)ix->detOnSamples[i] * OCC_FULL / SAMPLES_PER_MINUTE);
+		
+		ix->quarterVolume[i] += ix->detVolume[i];
+		ix->quarterOccSum[i] += mBin->occupancy[i];
+		
+		ix->detVolume[i] = 0;
+		ix->detOnSamples[i] = 0;
+	}
+	ix->minuteCount++;
+	ix->detSamples = 0;
+	
+	//Close the quarter every MINUTE_BINS minutes
+	if(ix->minuteCount % MINUTE_BINS == 0)
+	{
+		qBin = &ix->quarterBins[ix->quarterCount % QUARTER_BINS];
+		for(i = 0; i < NUM_DETECTORS; i++)
+		{
+			qBin->volume[i] = ix->quarterVolume[i];
+			qBin->occupancy[i] = ix->quarterOccSum[i] / MINUTE_BINS;
+			
+			ix->quarterVolume[i] = 0;
+			ix->quarterOccSum[i] = 0;
+		}
+		ix->quarterCount++;
+	}
+	
+	OS_EXIT_CRITICAL();
+}
+
+
+//protoSendBins
+//Reply payload: kind, bins closed so far (low 16 bits), bins sent, then the bins newest first
+//A minute bin is 4 volumes then 4 occupancies, a quarter bin the same with 16 bit volumes
+//skip leaves out the newest bins, count is cut down to what is stored and what fits
+void protoSendBins(INT8U kind, INT8U skip, INT8U count)
+{
+	INT32U	closed,			//Bins closed so far
+			stored,			//Bins held in the buffer
+			index;			//Bin being sent
+	INT8U	sum,
+			len,
+			i,
+			j;
+	minuteBin mBin;
+	quarterBin qBin;
+	
+	//Work out how many bins can be sent
+	OS_ENTER_CRITICAL();
+	closed = kind == BIN_MINUTE ? ix->minuteCount : ix->quarterCount;
+	OS_EXIT_CRITICAL();
+	
+	stored = closed;
+	if(kind == BIN_MINUTE && stored > MINUTE_BINS)
+		stored = MINUTE_BINS;
+	if(kind == BIN_QUARTER && stored > QUARTER_BINS)
+		stored = QUARTER_BINS;
+	
+	if(skip >= stored)
+		count = 0;
+	else if(count > stored - skip)
+		count = stored - skip;
+	
+	if(kind == BIN_QUARTER && count > (255 - 4) / QUARTER_BIN_WIRE_SIZE)
+		count = (255 - 4) / QUARTER_BIN_WIRE_SIZE;
+	
+	len = 4 + count * (kind == BIN_MINUTE ? MINUTE_BIN_WIRE_SIZE : QUARTER_BIN_WIRE_SIZE);
+	
+	//Send the frame straight out, the bins are too big to buffer
+	sciPutByte(PROTO_SYNC);
+	sciPutByte(len);
+	sciPutByte(CMD_BINS_GET | PROTO_REPLY);
+	sciPutByte(kind);
+	sciPutByte((INT8U)(closed >> 8));
+	sciPutByte((INT8U)closed);
+	sciPutByte(count);
+	sum = len + (CMD_BINS_GET | PROTO_REPLY) + kind + (INT8U)(closed >> 8) + (INT8U)closed + count;
+	
+	for(i = 0; i < count; i++)
+	{
+		index = closed - 1 - skip - i;
+		
+		//Copy the bin so a minute closing meanwhile cannot tear it
+		if(kind == BIN_MINUTE)
+		{
+			OS_ENTER_CRITICAL();
+			mBin = ix->minuteBins[index % MINUTE_BINS];
+			OS_EXIT_CRITICAL();
+			
+			for(j = 0; j < NUM_DETECTORS; j++)
+			{
+				sciPutByte(mBin.volume[j]);
+				sum += mBin.volume[j];
+			}
+			for(j = 0; j < NUM_DETECTORS; j++)
+			{
+				sciPutByte(mBin.occupancy[j]);
+				sum += mBin.occupancy[j];
+			}
+		}
+		else
+		{
+			OS_ENTER_CRITICAL();
+			qBin = ix->quarterBins[index % QUARTER_BINS];
+			OS_EXIT_CRITICAL();
+			
+			for(j = 0; j < NUM_DETECTORS; j++)
+			{
+				sciPutByte(qBin.volume[j] >> 8);
+				sciPutByte(qBin.volume[j]);
+				sum += (qBin.volume[j] >> 8) + qBin.volume[j];
+			}
+			for(j = 0; j < NUM_DETECTORS; j++)
+			{
+				sciPutByte(qBin.occupancy[j]);
+				sum += qBin.occupancy[j];
+			}
+		}
+	}
+	
+	//Make the sum come out to 0
+	sciPutByte((INT8U)(0 - sum));
+}
+
+
+//kickWatchdog
+//Services the COP with the required 0x55 0xAA sequence
+void kickWatchdog()
+{
+	ARMCOP = 0x55;
+	ARMCOP = 0xAA;
+}
+
+
+//printMetrics
+//Outputs uptime and recovery metrics
+void printMetrics()
+{
+	printf("\nUPTIME %lu s  COLD %u  WARM %u  RESTARTS %u  STALLS %u  RECOVERY %lu ms (MAX %lu ms)\n",
+		OSTimeGet() / OS_TICKS_PER_SEC,
+		lastGood.coldBoots,
+		lastGood.warmBoots,
+		ix->ctrlMetrics.restarts,
+		ix->ctrlMetrics.stallRestarts,
+		ix->ctrlMetrics.lastRecoveryTicks * 1000 / OS_TICKS_PER_SEC,
+		ix->ctrlMetrics.maxRecoveryTicks * 1000 / OS_TICKS_PER_SEC);
+	
+	if(ix->phaseMode == MODE_ADAPTIVE)
+		printf("SPLIT TURN NS %u%%  EW %u%%  GO NS %u%%  EW %u%%\n",
+			ix->splitPct[0], ix->splitPct[1], ix->goPct[0], ix->goPct[1]);
+	
+	//Average bytes per telemetry update, to one decimal place
+	if(ix->ctrlMetrics.telemUpdates)
+		printf("TELEMETRY %lu UPDATES  %lu.%lu BYTES/UPDATE\n",
+			ix->ctrlMetrics.telemUpdates,
+			ix->ctrlMetrics.telemBytes / ix->ctrlMetrics.telemUpdates,
+			ix->ctrlMetrics.telemBytes * 10 / ix->ctrlMetrics.telemUpdates % 10);
+	
+	//Nodes and time of the last predictive decision, against the slowest one
+	if(ix->ctrlMetrics.mpcDecisions)
+		printf("MPC %lu DECISIONS  %lu NODES AVG  LAST %u NODES %u REFINED %lu us  MAX %lu us  %u CUT SHORT\n",
+			ix->ctrlMetrics.mpcDecisions,
+			ix->ctrlMetrics.mpcNodesTotal / ix->ctrlMetrics.mpcDecisions,
+			ix->ctrlMetrics.mpcNodes,
+			ix->ctrlMetrics.mpcRefined,
+			(INT32U)ix->ctrlMetrics.mpcCounts * TIMER_US_PER_COUNT,
+			(INT32U)ix->ctrlMetrics.mpcMaxCounts * TIMER_US_PER_COUNT,
+			ix->ctrlMetrics.mpcBudgetHits);
+	
+	if(ix->ctrlMetrics.consoleDropped)
+		printf("CONSOLE %u LINES DROPPED\n", ix->ctrlMetrics.consoleDropped);
+}
+
+
+//consolePuts
+//Called from any task, and from main() before the OS starts
+//Only the pointer is queued, so s must stay valid, a string constant
+//A line that finds the queue full is dropped and counted
+void consolePuts(const char* s)
+{
+	INT8U next;
+	
+	OS_ENTER_CRITICAL();
+	next = (ix->consoleHead + 1) & (CONSOLE_QUEUE_SIZE - 1);
+	if(next != ix->consoleTail)
+	{
+		ix->console[ix->consoleHead] = s;
+		ix->consoleHead = next;
+	}
+	else
+		ix->ctrlMetrics.consoleDropped++;
+	OS_EXIT_CRITICAL();
+}
+
+
+//consoleFlush
+//Called by the serial task every tick
+void consoleFlush()
+{
+	while(ix->consoleTail != ix->consoleHead)
+	{
+		puts(ix->console[ix->consoleTail]);
+		ix->consoleTail = (ix->consoleTail + 1) & (CONSOLE_QUEUE_SIZE - 1);
+	}
+}
+
+
+//telemetryImage
+//Takes the image in one go so it is consistent
+void telemetryImage(INT8U* image)
+{
+	OS_ENTER_CRITICAL();
+	image[0] = ix->cState.lstate;
+	image[1] = ix->cState.astate;
+	image[2] = PORTA;
+	image[3] = PORTB;
+	image[4] = PTH;
+	image[5] = PTT;
+	image[6] = PORTK;
+	image[7] = ix->cflags;
+	OS_EXIT_CRITICAL();
+}
+
+
+//telemetryPoll
+//Called by the serial task every tick
+//Compares the image with what was last sent and sends the smallest frame that covers it
+void telemetryPoll()
+{
+	INT8U	image[TELEM_FIELDS],		//Image now
+			payload[TELEM_FIELDS + 2],	//Frame being built
+			diff,
+			mask,
+			changed,				//Fields that changed
+			len,
+			i,
+			bit;
+	INT32U	now;
+	
+	telemetryImage(image);
+	
+	now = OSTimeGet();
+	payload[0] = ix->telemSeq;
+	
+	//Keyframe when due
+	if(!ix->telemStarted || now - ix->telemKeyTick >= (INT32U)TELEM_KEYFRAME_SECS * OS_TICKS_PER_SEC)
+	{
+		for(i = 0; i < TELEM_FIELDS; i++)
+			payload[1 + i] = image[i];
+		
+		protoSendFrame(TELEM_KEYFRAME, payload, 1 + TELEM_FIELDS);
+		len = 1 + TELEM_FIELDS;
+		
+		ix->telemStarted = 1;
+		ix->telemKeyTick = now;
+	}
+	else
+	{
+		//XOR every field against what the receiver has
+		mask = 0;
+		changed = 0;
+		for(i = 0; i < TELEM_FIELDS; i++)
+		{
+			diff = image[i] ^ ix->telemLast[i];
+			if(diff)
+			{
+				mask |= 1 << i;
+				payload[2 + changed++] = diff;
+			}
+		}
+		
+		//Nothing to send
+		if(!mask)
+			return;
+		
+		//A single bit flip, the usual case for a sensor, fits in one byte
+		diff = payload[2];
+		if(changed == 1 && !(diff & (diff - 1)))
+		{
+			for(i = 0; !(mask & (1 << i)); i++)
+				;
+			for(bit = 0; !(diff & (1 << bit)); bit++)
+				;
+			
+			payload[1] = i << 3 | bit;
+			len = 2;
+			protoSendFrame(TELEM_BIT, payload, len);
+		}
+		else
+		{
+			payload[1] = mask;
+			len = 2 + changed;
+			protoSendFrame(TELEM_DELTA, payload, len);
+		}
+	}
+	
+	for(i = 0; i < TELEM_FIELDS; i++)
+		ix->telemLast[i] = image[i];
+	ix->telemSeq++;
+	
+	ix->ctrlMetrics.telemBytes += len + PROTO_OVERHEAD;
+	ix->ctrlMetrics.telemUpdates++;
+}
+
+
+//noteServed
+//Called by the cycle as a state ends
+//Turns in the state have just been served, and a go state ends its axis' green
+void noteServed(lightState endState)
+{
+	INT8U i;
+	
+	//Turn bits run W, E, S, N from bit 4, sensor bits N, S, E, W from bit 0
+	for(i = 0; i < NUM_DETECTORS; i++)
+		if(endState.lstate & (TURN_NORTH >> i))
+			ix->turnServedTick[i] = ix->schedNow;
+	
+	if(endState.lstate & (LIGHT_NORTH | LIGHT_SOUTH))
+		ix->axisGreenEndTick[0] = ix->schedNow;
+	if(endState.lstate & (LIGHT_EAST | LIGHT_WEST))
+		ix->axisGreenEndTick[1] = ix->schedNow;
+}
+
+
+//mpcSegment
+//Fluid queue model over ds deciseconds
+//Movements in served discharge at saturation flow, the rest only queue
+//Adds the delay to the state's cost
+void mpcSegment(mpcState* st, INT16U ds, INT8U served, INT16U* lambda)
+{
+	INT32S	q,			//Queue at the start
+			a,			//Arrival rate
+			net,		//Discharge rate less arrivals
+			tc,			//Time to clear the queue
+			delay;		//Delay over the segment (mveh ds)
+	INT8U	m;
+	
+	for(m = 0; m < NUM_MOVEMENTS; m++)
+	{
+		q = st->queue[m];
+		a = lambda[m];
+		
+		if(served & (1 << m))
+		{
+			net = (m < NUM_DETECTORS ? SAT_TURN_RATE : SAT_THROUGH_RATE) - a;
+			
+			if(net <= 0)
+			{
+				//Oversaturated, the queue still grows
+				delay = q * ds - net * ds * ds / 2;
+				q -= net * ds;
+			}
+			else
+			{
+				tc = q / net;
+				if(tc >= ds)
+				{
+					//Queue shrinks but does not clear
+					delay = q * ds - net * ds * ds / 2;
+					q -= net * ds;
+				}
+				else
+				{
+					//Queue clears, later arrivals go straight through
+					delay = q * tc / 2;
+					q = 0;
+				}
+			}
+		}
+		else
+		{
+			//Red, everyone waits
+			delay = q * ds + a * ds * ds / 2;
+			q += a * ds;
+		}
+		
+		if(q > MPC_MAX_QUEUE)
+			q = MPC_MAX_QUEUE;
+		
+		st->queue[m] = q;
+		st->cost += delay / 1000;
+	}
+}
+
+
+//mpcDecode
+//Turns an action number into a half cycle
+//sel is the turns given a turn phase, bit 0 the N or E turn and bit 1 the S or W turn
+//Action 0 is the greedy choice, the one rollouts use after their first half cycle
+void mpcDecode(INT8U action, INT8U greedy, INT8U* sel, INT16U* turnMs, INT16U* goMs)
+{
+	INT8S	turnStep,	//-1, 0 or +1 MPC_STEP_MS from the plan
+			goStep;
+	INT32S	ms;
+	
+	if(action == 0)
+	{
+		*sel = greedy;
+		turnStep = 0;
+		goStep = 0;
+	}
+	else if(action < 4)
+	{
+		*sel = 0;
+		turnStep = 0;
+		goStep = action - 2;
+	}
+	else
+	{
+		action -= 4;
+		*sel = 1 + action / 9;
+		turnStep = (action / 3) % 3 - 1;
+		goStep = action % 3 - 1;
+	}
+	
+	//Plan times moved by the steps, kept within the plan limits
+	ms = (INT32S)ix->plans[ix->activePlan].turnMs + turnStep * MPC_STEP_MS;
+	if(ms < PLAN_MIN_GREEN_MS)
+		ms = PLAN_MIN_GREEN_MS;
+	if(ms > PLAN_MAX_GREEN_MS)
+		ms = PLAN_MAX_GREEN_MS;
+	*turnMs = (INT16U)ms;
+	
+	ms = (INT32S)(*sel ? ix->plans[ix->activePlan].turnGoMs : ix->plans[ix->activePlan].goMs) + goStep * MPC_STEP_MS;
+	if(ms < PLAN_MIN_GREEN_MS)
+		ms = PLAN_MIN_GREEN_MS;
+	if(ms > PLAN_MAX_GREEN_MS)
+		ms = PLAN_MAX_GREEN_MS;
+	*goMs = (INT16U)ms;
+}
+
+
+//mpcHalfCycle
+//Runs the half cycle action from mpcNode[depth] into mpcNode[depth + 1]
+//Returns 0, without running it, if it breaks the max wait rule
+INT8U mpcHalfCycle(INT8U depth, INT8U action)
+{
+	mpcState* st;
+	INT16U	turnMs,
+			goMs,
+			turnDs,
+			goDs;
+	INT8U	axis,
+			greedy,
+			sel,
+			served,
+			i;
+	INT32S	ds;
+	
+	axis = (mpcFirstAxis + depth) & 1;
+	st = &mpcNode[depth];
+	
+	//On the first half cycle greedy is what the flags ask for,
+	//after that it means serve any turn with a queue
+	if(depth == 0)
+		greedy = (ix->cflags >> (axis * 2)) & 3;
+	else
+	{
+		greedy = 0;
+		if(st->queue[axis * 2] >= 1000)
+			greedy |= 1;
+		if(st->queue[axis * 2 + 1] >= 1000)
+			greedy |= 2;
+	}
+	
+	mpcDecode(action, greedy, &sel, &turnMs, &goMs);
+	
+	//Max wait: a turn with a queue that has waited too long must be served
+	if((st->wait[axis * 2] >= MPC_MAX_WAIT_DS && st->queue[axis * 2] >= 1000 && !(sel & 1))
+		|| (st->wait[axis * 2 + 1] >= MPC_MAX_WAIT_DS && st->queue[axis * 2 + 1] >= 1000 && !(sel & 2)))
+		return 0;
+	
+	//Run the half cycle on a copy of the state
+	mpcNode[depth + 1] = *st;
+	st = &mpcNode[depth + 1];
+	ix->ctrlMetrics.mpcNodes++;
+	
+	turnDs = turnMs / 100;
+	goDs = goMs / 100;
+	
+	//All red
+	mpcSegment(st, mpcAllRedDs[axis], 0, mpcLambda);
+	
+	//Turn phase and its yellow
+	//A single turn phase also runs that approach's through (N_TURN and so on)
+	if(sel)
+	{
+		served = sel << (axis * 2);
+		if(sel != 3)
+			served |= served << NUM_DETECTORS;
+		mpcSegment(st, MPC_LOST_DS, 0, mpcLambda);
+		mpcSegment(st, turnDs - MPC_LOST_DS, served, mpcLambda);
+		mpcSegment(st, mpcTurnYellowDs[axis], 0, mpcLambda);
+	}
+	
+	//Go phase and its yellow
+	mpcSegment(st, MPC_LOST_DS, 0, mpcLambda);
+	mpcSegment(st, goDs - MPC_LOST_DS, 3 << (NUM_DETECTORS + axis * 2), mpcLambda);
+	mpcSegment(st, mpcGoYellowDs[axis], 0, mpcLambda);
+	
+	//Turn waits
+	ds = mpcAllRedDs[axis] + (sel ? turnDs + mpcTurnYellowDs[axis] : 0) + goDs + mpcGoYellowDs[axis];
+	st->elapsed += ds;
+	for(i = 0; i < NUM_DETECTORS; i++)
+	{
+		if(i / 2 == axis && sel & (1 << (i & 1)))
+			st->wait[i] = 0;
+		else if(st->wait[i] + ds > 0xFFFF)
+			st->wait[i] = 0xFFFF;
+		else
+			st->wait[i] += ds;
+	}
+	
+	return 1;
+}
+
+
+//mpcRollout
+//Runs action at depth, then the greedy action at every depth after it
+//Greedy serves every turn with a queue, so it never breaks the max wait rule
+//Returns the average queue over the sequence in hundredths of a vehicle,
+//or MPC_NO_SCORE if action breaks the max wait rule
+INT32S mpcRollout(INT8U depth, INT8U action)
+{
+	for(; depth < MPC_HORIZON; depth++)
+	{
+		if(!mpcHalfCycle(depth, action))
+			return MPC_NO_SCORE;
+		action = 0;
+	}
+	
+	return mpcNode[MPC_HORIZON].cost * 100 / mpcNode[MPC_HORIZON].elapsed;
+}
+
+
+//predictNextState
+//Predictive replacement for determineNextState at the top of a cycle
+//Scores every first half cycle with a greedy rollout to the horizon, then
+//searches the second half cycle under the MPC_REFINE cheapest first ones
+//Sets phaseTurnMs and phaseGoMs for the half cycle it picks
+lightState predictNextState(lightState currState)
+{
+	lightState nextState;
+	INT16U	volume;
+	INT8U	axis,
+			greedy,
+			sel,
+			first,			//First half cycle being searched under
+			action,
+			bestAction,
+			i,
+			n;
+	INT32U	searched;		//First half cycles already searched under, one bit each
+	INT16U	start;			//TCNT at the start of the decision
+	INT32S	best,
+			cost,
+			ds;
+	mpcState* st;
+	
+	nextState.astate = 0;
+	start = TCNT;
+	
+	//Check the sensors for any input (also sets flags)
+	checkSensors();
+	
+	//NS follows EW and ALL_STOP, EW follows NS
+	mpcFirstAxis = currState.lstate == NS_GO ? 1 : 0;
+	
+	//Turn arrival rates from the last few minute bins, veh/min to mveh/ds,
+	//through arrival rates from the configured demand, veh/h to mveh/ds
+	n = ix->minuteCount < MPC_HISTORY_MINUTES ? ix->minuteCount : MPC_HISTORY_MINUTES;
+	for(i = 0; i < NUM_DETECTORS; i++)
+	{
+		volume = 0;
+		for(action = 0; action < n; action++)
+			volume += ix->minuteBins[(ix->minuteCount - 1 - action) % MINUTE_BINS].volume[i];
+		mpcLambda[i] = n ? volume * 5 / (3 * n) : 0;
+		mpcLambda[NUM_DETECTORS + i] = ix->throughVph[i] / 36;
+	}
+	
+	//Starting queues
+	st = &mpcNode[0];
+	st->cost = 0;
+	st->elapsed = 0;
+	for(i = 0; i < NUM_DETECTORS; i++)
+	{
+		//Turns: everything that arrived since the last turn phase
+		ds = (INT32S)((ix->schedNow - ix->turnServedTick[i]) * 10 / OS_TICKS_PER_SEC);
+		if(ds > 0xFFFF)
+			ds = 0xFFFF;
+		st->wait[i] = (INT16U)ds;
+		st->queue[i] = mpcLambda[i] * ds;
+		
+		//A car sitting on the detector is at least one vehicle
+		if(ix->cflags & (1 << i) && st->queue[i] < 1000)
+			st->queue[i] = 1000;
+		
+		//Throughs: everything that arrived since their axis' green ended
+		ds = (INT32S)((ix->schedNow - ix->axisGreenEndTick[i / 2]) * 10 / OS_TICKS_PER_SEC);
+		if(ds > 0xFFFF)
+			ds = 0xFFFF;
+		st->queue[NUM_DETECTORS + i] = mpcLambda[NUM_DETECTORS + i] * ds;
+		
+		if(st->queue[i] > MPC_MAX_QUEUE)
+			st->queue[i] = MPC_MAX_QUEUE;
+		if(st->queue[NUM_DETECTORS + i] > MPC_MAX_QUEUE)
+			st->queue[NUM_DETECTORS + i] = MPC_MAX_QUEUE;
+	}
+	
+	//An axis' all red clears the other axis' throughs
+	for(axis = 0; axis < 2; axis++)
+	{
+		i = axis * 2;
+		mpcTurnYellowDs[axis] = (ix->yellowClearMs[i] > ix->yellowClearMs[i + 1] ? ix->yellowClearMs[i] : ix->yellowClearMs[i + 1]) / 100;
+		i += NUM_DETECTORS;
+		mpcGoYellowDs[axis] = (ix->yellowClearMs[i] > ix->yellowClearMs[i + 1] ? ix->yellowClearMs[i] : ix->yellowClearMs[i + 1]) / 100;
+		mpcAllRedDs[axis ^ 1] = (ix->redClearMs[i] > ix->redClearMs[i + 1] ? ix->redClearMs[i] : ix->redClearMs[i + 1]) / 100;
+	}
+	
+	ix->ctrlMetrics.mpcNodes = 0;
+	
+	//Score every first half cycle, greedy after it
+	//Greedy is first so a tie keeps what determineNextState would do
+	best = MPC_NO_SCORE;
+	bestAction = 0;
+	for(action = 0; action < MPC_ACTIONS; action++)
+	{
+		mpcScore[action] = mpcRollout(0, action);
+		if(mpcScore[action] < best)
+		{
+			best = mpcScore[action];
+			bestAction = action;
+		}
+	}
+	
+	//Try every second half cycle under the cheapest first half cycles,
+	//each followed by greedy ones
+	searched = 0;
+	first = 0;
+	for(ix->ctrlMetrics.mpcRefined = 0; ix->ctrlMetrics.mpcRefined < MPC_REFINE; ix->ctrlMetrics.mpcRefined++)
+	{
+		//The budget covers the whole search, this only guards a change to it
+		if(ix->ctrlMetrics.mpcNodes + 1 + MPC_ACTIONS * (MPC_HORIZON - 1) > MPC_NODE_BUDGET)
+		{
+			ix->ctrlMetrics.mpcBudgetHits++;
+			break;
+		}
+		
+		//Cheapest scored first half cycle not searched under yet
+		first = MPC_ACTIONS;
+		for(action = 0; action < MPC_ACTIONS; action++)
+		{
+			if(!(searched & (INT32U)1 << action) && mpcScore[action] != MPC_NO_SCORE
+				&& (first == MPC_ACTIONS || mpcScore[action] < mpcScore[first]))
+				first = action;
+		}
+		if(first == MPC_ACTIONS)
+			break;
+		searched |= (INT32U)1 << first;
+		
+		mpcHalfCycle(0, first);
+		for(action = 0; action < MPC_ACTIONS; action++)
+		{
+			cost = mpcRollout(1, action);
+			if(cost < best)
+			{
+				best = cost;
+				bestAction = first;
+			}
+		}
+	}
+	
+	ix->ctrlMetrics.mpcDecisions++;
+	ix->ctrlMetrics.mpcNodesTotal += ix->ctrlMetrics.mpcNodes;
+	
+	//The first half cycle of the best sequence
+	//If every sequence breaks the max wait rule this is the greedy one
+	greedy = (ix->cflags >> (mpcFirstAxis * 2)) & 3;
+	mpcDecode(bestAction, greedy, &sel, &ix->phaseTurnMs, &ix->phaseGoMs);
+	
+	if(mpcFirstAxis == 0)
+	{
+		if(sel == 3)
+			nextState.lstate = NS_TURN;
+		else if(sel == 1)
+			nextState.lstate = N_TURN;
+		else if(sel == 2)
+			nextState.lstate = S_TURN;
+		else
+			nextState.lstate = NS_GO;
+	}
+	else
+	{
+		if(sel == 3)
+			nextState.lstate = EW_TURN;
+		else if(sel == 1)
+			nextState.lstate = E_TURN;
+		else if(sel == 2)
+			nextState.lstate = W_TURN;
+		else
+			nextState.lstate = EW_GO;
+	}
+	
+	//Walk with the go states, as determineNextState does
+	if(nextState.lstate == EW_GO)
+		nextState.astate = WALK_EW;
+	if(nextState.lstate == NS_GO)
+		nextState.astate = WALK_NS;
+	
+	//Clear the flags
+	ix->cflags = 0;
+	
+	//Time taken, interrupts and all, wrapping TCNT included
+	ix->ctrlMetrics.mpcCounts = TCNT - start;
+	if(ix->ctrlMetrics.mpcCounts > ix->ctrlMetrics.mpcMaxCounts)
+		ix->ctrlMetrics.mpcMaxCounts = ix->ctrlMetrics.mpcCounts;
+	
+	return nextState;
+}
+
+//updateSplit
+//Called by the main cycle at the top of every cycle
+//Acts once both axes have had green since the last time
+void updateSplit()
+{
+	INT16U	sat[2],		//Degree of saturation per axis, OCC_FULL = 100%
+			vph;		//Busier approach's through demand
+	INT16S	total,		//Sum of the scales
+			target,		//NS scale the saturation asks for
+			ns;			//New NS scale
+	INT8U	axis;
+	
+	if(ix->splitServed != 3)
+		return;
+	ix->splitServed = 0;
+	
+	//Detectors covered for the whole of their turn greens is full saturation
+	//No turn phase on an axis is no saturation
+	//sampleDetectors runs in this task, so no critical section is needed
+	for(axis = 0; axis < 2; axis++)
+	{
+		sat[axis] = ix->splitGreenSamples[axis] ? (INT32U)ix->splitOccSamples[axis] * OCC_FULL / ix->splitGreenSamples[axis] : 0;
+		ix->splitGreenSamples[axis] = 0;
+		ix->splitOccSamples[axis] = 0;
+	}
+	
+	//Measured in every mode, only adaptive mode moves the split
+	if(ix->phaseMode != MODE_ADAPTIVE)
+		return;
+	
+	//Cycle length
+	total = ix->splitPct[0] + ix->splitPct[1];
+	if(sat[0] > SPLIT_SAT_HIGH || sat[1] > SPLIT_SAT_HIGH)
+		total += SPLIT_STEP_PCT;
+	else if(sat[0] < SPLIT_SAT_LOW && sat[1] < SPLIT_SAT_LOW)
+		total -= SPLIT_STEP_PCT;
+	if(total < SPLIT_MIN_TOTAL_PCT)
+		total = SPLIT_MIN_TOTAL_PCT;
+	if(total > SPLIT_MAX_TOTAL_PCT)
+		total = SPLIT_MAX_TOTAL_PCT;
+	
+	//NS share of the total by saturation, even when nothing is measured
+	if(sat[0] + sat[1])
+		target = (INT32S)total * sat[0] / (sat[0] + sat[1]);
+	else
+		target = total / 2;
+	
+	//Keep the NS share it had, then move one step towards the target
+	ns = (INT32S)ix->splitPct[0] * total / (ix->splitPct[0] + ix->splitPct[1]);
+	if(target > ns + SPLIT_STEP_PCT)
+		ns += SPLIT_STEP_PCT;
+	else if(target < ns - SPLIT_STEP_PCT)
+		ns -= SPLIT_STEP_PCT;
+	else
+		ns = target;
+	
+	//Both scales within their limits, EW gets the rest of the total
+	if(ns < SPLIT_MIN_PCT || total - ns > SPLIT_MAX_PCT)
+		ns = total - SPLIT_MAX_PCT > SPLIT_MIN_PCT ? total - SPLIT_MAX_PCT : SPLIT_MIN_PCT;
+	if(ns > SPLIT_MAX_PCT || total - ns < SPLIT_MIN_PCT)
+		ns = total - SPLIT_MIN_PCT < SPLIT_MAX_PCT ? total - SPLIT_MIN_PCT : SPLIT_MAX_PCT;
+	
+	ix->splitPct[0] = ns;
+	ix->splitPct[1] = total - ns;
+	
+	//Go scales, one step towards the through demand over what the plan is sized for
+	for(axis = 0; axis < 2; axis++)
+	{
+		vph = ix->throughVph[axis * 2] > ix->throughVph[axis * 2 + 1] ? ix->throughVph[axis * 2] : ix->throughVph[axis * 2 + 1];
+		target = (INT32S)vph * 100 / PLAN_THROUGH_VPH;
+		if(target < SPLIT_MIN_PCT)
+			target = SPLIT_MIN_PCT;
+		if(target > SPLIT_MAX_PCT)
+			target = SPLIT_MAX_PCT;
+		
+		if(target > (INT16S)ix->goPct[axis] + SPLIT_STEP_PCT)
+			ix->goPct[axis] += SPLIT_STEP_PCT;
+		else if(target < (INT16S)ix->goPct[axis] - SPLIT_STEP_PCT)
+			ix->goPct[axis] -= SPLIT_STEP_PCT;
+		else
+			ix->goPct[axis] = target;
+	}
+}
+
+
+//splitGreen
+//Plan green ms scaled by pct, kept within the plan limits
+INT16U splitGreen(INT16U ms, INT16U pct)
+{
+	INT32U scaled;
+	
+	scaled = (INT32U)ms * pct / 100;
+	if(scaled < PLAN_MIN_GREEN_MS)
+		scaled = PLAN_MIN_GREEN_MS;
+	if(scaled > PLAN_MAX_GREEN_MS)
+		scaled = PLAN_MAX_GREEN_MS;
+	
+	return (INT16U)scaled;
+}
+
+
+
+/******************************************************
+			TASK DEFINITIONS
+******************************************************/
+
+//cycleThread
+//Handles the main cycle between states
+//Protothread, run by controllerTask whenever no ambulance has the lights
+INT8U cycleThread(protothread* pt)
+{
+	lightState stopState;	//Blank all red state
+	INT8U axis;				//Axis of the state starting, for the adaptive split
 	
 	//Setup all red state
+	//Nothing on the stack survives a wait, so this is done on every call
 	stopState.lstate = ALL_STOP;
 	stopState.astate = 0;
-     
-	//Set the walking state of nextstate to be 0 always
-	nextState.astate = 0;
-
+	
+	PT_BEGIN(pt);
+	
+	//Debug output code
+	consolePuts("\nENTERING MAIN LIGHT CYCLE TASK\n");
+	
+	//Clear the sensors
+	ix->cflags = 0;
+    
+	//Main cycle
 	while(1)
 	{
-		//Wait 1 second....IE. Poll the sensors every 1 second
-		OSTimeDlyHMSM(0,0,1,0);
+		//Cycle boundary, let the schedule move the plan on
+		//then pick up a newly uploaded or scheduled timing plan
+		schedulePlan();
+		applyPendingPlan();
+		updateSplit();
+		ix->cyclePredicted = 0;
 		
-		//Poll the sensors
-		//Sets flags in cflags
-		checkSensors();
-		
-		/*Next section all the same for the most part so only the first
-			segment is commented*/
-		
-		//If an ambulance is approaching from the north
-		if(cflags & NORTH_AMBULANCE_FLAG)
+		//Skip the all red and state change when resuming a warm boot
+		if(!ix->warmStart)
 		{
-			//DEBUG:  Print ambulance coming
-			puts("\nAmbulance Coming from North\n");
+			//The go green of the last state is over
+			noteServed(ix->cState);
 			
-			//Suspend the main light cycle task
-			OSTaskSuspend(mainTaskPrio);
+			//Change all of the lights to red
+			//NOTE:  cState is NOT changed here
+			//This is purely an INTERMEDIATE state
+			PT_CHANGE_LIGHTS(pt, stopState);
 			
-			//Change the lights to all red
-			changeLights(stopState);
+			//Wait for a period
+			PT_DELAY(pt, ix->allRedClearMs);
+
+			//Determine the next state after the current state
+			if(ix->phaseMode == MODE_PREDICTIVE)
+			{
+				ix->cycleNext = predictNextState(ix->cState);
+				ix->cyclePredicted = 1;
+			}
+			else
+				ix->cycleNext = determineNextState(ix->cState);
 			
-			//Wait 3 seconds at all red
-			OSTimeDlyHMSM(0,0,3,0);
+			//Change the lights to the next state
+			PT_CHANGE_LIGHTS(pt, ix->cycleNext);
 			
-			//Set the desired next state (N_TURN)
-			nextState.lstate = N_TURN;
+			//When done changing lights, change current state to reflect
+			ix->cState = ix->cycleNext;
+		}
+		ix->warmStart = 0;
+		
+		//Fixed and adaptive mode greens come from the plan
+		if(!ix->cyclePredicted)
+		{
+			ix->phaseTurnMs = ix->plans[ix->activePlan].turnMs;
+			if(ix->cState.lstate != EW_GO && ix->cState.lstate != NS_GO)
+				ix->phaseGoMs = ix->plans[ix->activePlan].turnGoMs;
+			else
+				ix->phaseGoMs = ix->plans[ix->activePlan].goMs;
 			
-			//Set cState to reflect LED status correctly
-			cState = stopState;
+			//Adaptive mode gives the busier axis' turns and throughs more time
+			if(ix->phaseMode == MODE_ADAPTIVE)
+			{
+				axis = ix->cState.lstate & NS_MOVEMENTS ? 0 : 1;
+				ix->phaseTurnMs = splitGreen(ix->phaseTurnMs, ix->splitPct[axis]);
+				ix->phaseGoMs = splitGreen(ix->phaseGoMs, ix->goPct[axis]);
+			}
+		}
+		
+		//DEBUG:  Print the current state
+		printStatus(ix->cState);
+
+		//Turn signal handling
+		//Since the waiting time is different for go states and turn states
+		
+		//If there is a turning state active (IE. not a GO state)
+		if(ix->cState.lstate != EW_GO && ix->cState.lstate != NS_GO)
+		{
+			//Wait a period with the turning light green
+			PT_DELAY(pt, ix->phaseTurnMs);
 			
-			//DEBUG
-			//printStatus(cState);
+			//The turn phase is over
+			noteServed(ix->cState);
 			
-			//Change the lights so the ambulance can go
-			changeLights(nextState);
+			//Determine the next state
+			ix->cycleNext = determineNextState(ix->cState);
+			
+			//DEBUG CODE
+			//puts("\nTURN STATE\n");
 			
-			//Set the current state correctly
-			cState = nextState;
+			//Change the lights
+			PT_CHANGE_LIGHTS(pt, ix->cycleNext);
 			
-			//Give the ambulance 10 seconds to go
-			OSTimeDlyHMSM(0,0,10,0);
+			//Set the current state to reflect change
+			ix->cState = ix->cycleNext;
 			
-			/* NEXT PART TRICKY
-			I'd prefer to restart the mainTask but I have no
-			idea where it would be.  So we have to create a new one.
+			//DEBUG:  Print current state
+			printStatus(ix->cState);
 			
-			LONG TERM MEMORY LEAK!!!!!!
-			VERY BAD CODING!  BAD BAD BAD GEORGE!!
+			//Wait a period with the go light green
+			PT_DELAY(pt, ix->phaseGoMs);
+		}
+		else
+		{
+			//If not a turning state, wait a period with lights green
+			PT_DELAY(pt, ix->phaseGoMs);
+		}
+	}
+	
+	PT_END(pt);
+}
+
+//ambulanceThread
+//Handles when an ambulance is detected
+//Protothread, run by controllerTask ahead of the light cycle
+INT8U ambulanceThread(protothread* pt)
+{
+	lightState stopState;	//All red state
+	
+	//Setup all red state
+	//Nothing on the stack survives a wait, so this is done on every call
+	stopState.lstate = ALL_STOP;
+	stopState.astate = 0;
+	
+	PT_BEGIN(pt);
+	
+	//DEBUG:  Print code signalling task start
+	consolePuts("\nENTERING AMBULANCE HANDLER\n");
+     
+	//Set the walking state of ambTarget to be 0 always
+	ix->ambTarget.astate = 0;
+
+	while(1)
+	{
+		//Wait 1 second....IE. Poll the sensors every 1 second
+		PT_DELAY(pt, 1000);
+		
+		//Poll the sensors
+		//Sets flags in cflags
+		checkSensors();
+		
+		//Pick the state for the approaching ambulance
+		if(!ambulanceState(&ix->ambTarget))
+			continue;
+		
+		//Ask for the lights
+		//The light cycle stops between light changes, never in the middle of a yellow
+		ix->preemptRequest = 1;
+		PT_WAIT_UNTIL(pt, ix->preempted);
+		
+		//Remember what the light cycle was showing so it can be put back
+		ix->ambResume = ix->cState;
+		ix->ambResumeLeds = ix->ledState;
+		
+		//Hold the lights for as long as ambulances keep coming
+		do
+		{
+			//A new direction goes through all red first
+			if(ix->ledState.lstate != ix->ambTarget.lstate)
+			{
+				//Change the lights to all red
+				PT_CHANGE_LIGHTS(pt, stopState);
+				
+				//Wait at all red
+				PT_DELAY(pt, ix->allRedClearMs);
+				
+				//Change the lights so the ambulance can go
+				PT_CHANGE_LIGHTS(pt, ix->ambTarget);
+			}
 			
-			But works for our purposes.*/
+			//Give the ambulance time to go
+			PT_DELAY(pt, AMBULANCE_GREEN_MS);
 			
-			//Increase mainTaskPrio once
-			mainTaskPrio++;
+			//Check for another ambulance
+			checkSensors();
+		}
+		while(ambulanceState(&ix->ambTarget));
+		
+		//Put back what the light cycle was showing, through all red
+		PT_CHANGE_LIGHTS(pt, stopState);
+		PT_DELAY(pt, ix->allRedClearMs);
+		
+		if(ix->ambResumeLeds.lstate != ALL_STOP)
+		{
+			PT_CHANGE_LIGHTS(pt, ix->ambResumeLeds);
+		}
+		ix->cState = ix->ambResume;
+		
+		//Hand the lights back, the light cycle carries on where it was
+		ix->preemptRequest = 0;
+	}
+	
+	PT_END(pt);
+}
+
+//ambulanceState
+//Sets the state for an ambulance flagged in cflags
+//Returns 0 if there is no ambulance
+INT8U ambulanceState(lightState* ambState)
+{
+	/*Next section all the same for the most part so only the first
+		segment is commented*/
+	
+	//If an ambulance is approaching from the north
+	if(ix->cflags & NORTH_AMBULANCE_FLAG)
+	{
+		//DEBUG:  Print ambulance coming
+		consolePuts("\nAmbulance Coming from North\n");
+		
+		//Set the desired next state (N_TURN)
+		ambState->lstate = N_TURN;
+	}
+	else if(ix->cflags & SOUTH_AMBULANCE_FLAG)
+	{
+		consolePuts("\nAmbulance Coming from South\n");
+		ambState->lstate = S_TURN;
+	}
+	else if(ix->cflags & EAST_AMBULANCE_FLAG)
+	{
+		consolePuts("\nAmbulance Coming from East\n");
+		ambState->lstate = E_TURN;
+	}
+	else if(ix->cflags & WEST_AMBULANCE_FLAG)
+	{
+		consolePuts("\nAmbulance Coming from West\n");
+		ambState->lstate = W_TURN;
+	}
+	else
+		return 0;
+	
+	return 1;
+}
+
+//controllerStep
+//Runs both protothreads once at tick now, with inputs as the sensor port
+//The ambulance thread goes first so a preemption takes effect in the same tick
+//The tick and the sensors both come from the caller, so the same sequence of
+//calls always drives the lights through the same sequence of states
+void controllerStep(INT32U now, INT8U inputs)
+{
+	ix->schedNow = now;
+	ix->schedInputs = inputs;
+	
+	//Count traffic on every step, whatever the lights are doing
+	sampleDetectors();
+	
+	ambulanceThread(&ix->ambulancePt);
+	
+	//Grant a preemption once the light cycle is between light changes
+	//Its delay is frozen so it gets the rest of it afterwards
+	if(ix->preemptRequest && !ix->preempted && !ix->lightsChanging)
+	{
+		ix->preemptRemaining = (INT32S)(ix->cyclePt.wake - ix->schedNow) > 0 ? ix->cyclePt.wake - ix->schedNow : 0;
+		ix->preempted = 1;
+		
+		//Let the ambulance thread start in this tick
+		ambulanceThread(&ix->ambulancePt);
+	}
+	
+	//The ambulance handed the lights back, resume the light cycle where it was
+	if(!ix->preemptRequest && ix->preempted)
+	{
+		ix->cyclePt.wake = ix->schedNow + ix->preemptRemaining;
+		ix->cyclePt.progress = ix->schedNow;
+		ix->preempted = 0;
+	}
+	
+	if(!ix->preempted)
+		cycleThread(&ix->cyclePt);
+}
+
+//Controller task
+//Runs the protothreads every tick on one stack
+void controllerTask(void* PDATA)
+{
+	//A warm boot or a restart counts as recovered once the threads run again
+	if(recovering)
+	{
+		ix->ctrlMetrics.lastRecoveryTicks = OSTimeGet() - recoveryStart;
+		if(ix->ctrlMetrics.lastRecoveryTicks > ix->ctrlMetrics.maxRecoveryTicks)
+			ix->ctrlMetrics.maxRecoveryTicks = ix->ctrlMetrics.lastRecoveryTicks;
+		recovering = 0;
+	}
+	
+	while(1)
+	{
+		controllerStep(OSTimeGet(), PORTA);
+		
+		//Run again next tick
+		OSTimeDly(1);
+	}
+}
+
+//Supervisor task
+//Lowest priority task, so it only runs while the others are blocked
+//and a task hogging the CPU stops it servicing the COP
+//Services the COP only while the light threads keep making progress
+void supervisor(void* PDATA)
+{
+	INT32U	now,			//Current tick
+			lastReport;		//Tick of the last metrics report
+	INT8U	stalled,		//Threads that stopped finishing their waits
+			stallRestarts;	//Restarts that have not yet been followed by a quiet spell
+	
+	lastReport = OSTimeGet();
+	stallRestarts = 0;
+	
+	while(1)
+	{
+		OSTimeDlyHMSM(0,0,0,SUPERVISOR_PERIOD_MS);
+		
+		now = OSTimeGet();
+		
+		//The light cycle does not run while an ambulance has the lights
+		stalled = 0;
+		if(!ix->preempted && now - ix->cyclePt.progress > CYCLE_STALL_TICKS)
+			stalled |= STALL_CYCLE;
+		if(now - ix->ambulancePt.progress > AMBULANCE_STALL_TICKS)
+			stalled |= STALL_AMBULANCE;
+		
+		if(stalled)
+		{
+			//Too many restarts without progress, stop kicking and let the COP reset
+			if(stallRestarts >= MAX_STALL_RESTARTS)
+				continue;
 			
-			//Start a new mainlightcycle task using new priority
-			//New task correctly picks up where it should
-			OSTaskCreate(MainLightCycle, (void *) 1, &MainLightCycleStk[TASK_STK_SIZE], mainTaskPrio);
+			//Restart it in place
+			consolePuts("\nCONTROLLER STALLED, RESTARTING\n");
+			stallRestarts++;
+			ix->ctrlMetrics.stallRestarts++;
+			restartController(stalled);
 		}
-		else if(cflags & SOUTH_AMBULANCE_FLAG)
+		//A restart helped once the threads have run through twice the longest stall time
+		else if(stallRestarts && now - recoveryStart > 2 * CYCLE_STALL_TICKS)
+			stallRestarts = 0;
+		
+		//Everything is checking in
+		kickWatchdog();
+		
+		//Sample the stack high water marks
+		checkStacks();
+		
+		//Periodic metrics report
+		if(now - lastReport >= (INT32U)METRICS_REPORT_SECS * OS_TICKS_PER_SEC)
 		{
-			puts("\nAmbulance Coming from South\n");
-			OSTaskSuspend(mainTaskPrio);
-			changeLights(stopState);
-			nextState.lstate = S_TURN;
-			cState = stopState;
-			changeLights(nextState);
-			cState = nextState;
-			OSTimeDlyHMSM(0,0,10,0);
-			mainTaskPrio++;
-			OSTaskCreate(MainLightCycle, (void *) 1, &MainLightCycleStk[TASK_STK_SIZE], mainTaskPrio);
-		}
-		else if(cflags & EAST_AMBULANCE_FLAG)
-		{
-			puts("\nAmbulance Coming from East\n");
-			OSTaskSuspend(mainTaskPrio);
-			changeLights(stopState);
-			nextState.lstate = E_TURN;
-			cState = stopState;
-			changeLights(nextState);
-			cState = nextState;
-			OSTimeDlyHMSM(0,0,10,0);
-			mainTaskPrio++;
-			OSTaskCreate(MainLightCycle, (void *) 1, &MainLightCycleStk[TASK_STK_SIZE], mainTaskPrio);
-		}
-		else if(cflags & WEST_AMBULANCE_FLAG)
-		{
-			puts("\nAmbulance Coming from West\n");
-			OSTaskSuspend(mainTaskPrio);
-			changeLights(stopState);
-			nextState.lstate = W_TURN;
-			cState = stopState;
-			changeLights(nextState);
-			cState = nextState;
-			OSTimeDlyHMSM(0,0,10,0);
-			mainTaskPrio++;
-			OSTaskCreate(MainLightCycle, (void *) 1, &MainLightCycleStk[TASK_STK_SIZE], mainTaskPrio);
+			lastReport = now;
+			ix->reportDue = 1;
 		}
 	}
 }
 
+//Serial step
+//Everything this sends goes out whole before the next thing starts,
+//and no other task writes SCI0, so frames and console lines never interleave
+void serialStep()
+{
+	INT8U data;
+	
+	while(serialRxTail != serialRxHead)
+	{
+		data = serialRx[serialRxTail];
+		serialRxTail = (serialRxTail + 1) & (SERIAL_RX_SIZE - 1);
+		protoRxByte(data);
+	}
+	
+	consoleFlush();
+	
+	//The supervisor only asks for the report, its printf runs here
+	if(ix->reportDue)
+	{
+		ix->reportDue = 0;
+		printMetrics();
+		printStacks();
+	}
+	
+	telemetryPoll();
+}
+
+//Serial handler task
+//The only task that writes SCI0
+//Drains the receive buffer into the frame parser and sends replies, console lines and telemetry
+void serialHandler(void* PDATA)
+{
+	while(1)
+	{
+		//Wait a tick, the interrupt buffers anything that arrives meanwhile
+		OSTimeDly(1);
+		
+		serialStep();
+	}
+}
+
 //Main
 //First function run at the start of everything
 int main()
 {
-	//Initialize the LEDs
-	initializeLights();
+	//Power on plans, LEDs and clearances
+	initIntersection();
+	
+	//After a COP reset put the last settled state straight back on the LEDs
+	//The controller reports the boot as a recovery once it is running
+	ix->warmStart = restoreCheckpoint();
+	recovering = ix->warmStart;
+	recoveryStart = 0;
+	
+	//Start the COP watchdog
+	COPCTL = COP_RATE;
+	
+	//Start the free running timer
+	TSCR2 = TIMER_PRESCALE;
+	TSCR1 = TSCR1_TEN;
 	
 	//Initialize uCos
 	OSInit();
 	
-	//Set the main task priority
-	mainTaskPrio = 10;
-	
 	//DEBUG
 	//Print starting tasks
-	printf("CREATING TASKS\n");
+	consolePuts("CREATING TASKS\n");
 	
-	//Create the main light cycle task using the mainTaskPrio variable
-	OSTaskCreate(MainLightCycle, (void *) 1, &MainLightCycleStk[TASK_STK_SIZE], mainTaskPrio);
+	//Create the controller task running the light cycle and ambulance handler
+	//All stacks are painted so the supervisor can measure them
+	createController();
 	
-	//Create the ambulance handling task
-	OSTaskCreate(ambulanceHandler, (void *) 1, &ambulanceHandlerStk[TASK_STK_SIZE],1);
+	//Create the supervisor task
+	OSTaskCreateExt(supervisor, (void *) 1, &supervisorStk[SUPERVISOR_STK_SIZE], SUPERVISOR_TASK_PRIO,
+		SUPERVISOR_TASK_PRIO, &supervisorStk[0], SUPERVISOR_STK_SIZE, (void *) 0,
+		OS_TASK_OPT_STK_CHK | OS_TASK_OPT_STK_CLR);
 	
-	//DEBUG:  LED TESTING TASK
-	//OSTaskCreate(testLEDs, (void *) 1, &testLEDsStk[TASK_STK_SIZE], mainTaskPrio);
+	//Create the serial command task
+	OSTaskCreateExt(serialHandler, (void *) 1, &serialStk[SERIAL_STK_SIZE], SERIAL_TASK_PRIO,
+		SERIAL_TASK_PRIO, &serialStk[0], SERIAL_STK_SIZE, (void *) 0,
+		OS_TASK_OPT_STK_CHK | OS_TASK_OPT_STK_CLR);
+	
+	//Let SCI0 receive commands, sciRxIsr is in the vector table from link time
+	SCI0CR2 |= SCI_RIE;
 
 	//DEBUG:  Print starting OS
-	printf("\nSTARTING OS\n");
+	consolePuts("\nSTARTING OS\n");
 
 	//Start multitasking
 	OSStart();
 
 	/* NEVER EXECUTED */
-	puts("main(): We should never execute this line\n");
+	consolePuts("main(): We should never execute this line\n");
 }
 
 //PrintStatus
@@ -912,41 +3654,41 @@ void printStatus(lightState currState)
 	switch (currState.lstate){
 
 		case ALL_STOP:
-			puts("ALL STOP\n");
+			consolePuts("ALL STOP\n");
 			break;
 
 		case EW_GO:
-			puts("EW GO\n");
+			consolePuts("EW GO\n");
 			break;
 
 		case NS_TURN:
-			puts("NS TURN\n");
+			consolePuts("NS TURN\n");
 			break;
 
 		case N_TURN:
-			puts("N TURN\n");
+			consolePuts("N TURN\n");
 			break;
 
 		case S_TURN:
-			puts("S TURN\n");
+			consolePuts("S TURN\n");
 			break;
 
 		case NS_GO:
-			puts("NS GO\n");
+			consolePuts("NS GO\n");
 			break;
 
 		case EW_TURN:
-			puts("EW TURN\n");
+			consolePuts("EW TURN\n");
 			break;
 
 		case E_TURN:
-			puts("E TURN\n");;
+			consolePuts("E TURN\n");;
 			break;
 
 		case W_TURN:
-			puts("W TURN\n");
+			consolePuts("W TURN\n");
 			break;
 
 	}
 
-}
\ No newline at end of file
+}